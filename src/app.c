@@ -22,14 +22,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "app.h"
 #include "bookmarks.h"
+#include "contentindex.h"
 #include "defs.h"
+#include "diskcache.h"
 #include "embedded.h"
 #include "feeds.h"
 #include "mimehooks.h"
 #include "gmcerts.h"
 #include "gmdocument.h"
+#include "gmrequest.h"
 #include "gmutil.h"
 #include "history.h"
+#include "media.h"
+#include "prefetch.h"
+#include "resolver.h"
 #include "ui/color.h"
 #include "ui/command.h"
 #include "ui/documentwidget.h"
@@ -42,12 +48,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "ui/window.h"
 #include "visited.h"
 
+#include <the_Foundation/buffer.h>
 #include <the_Foundation/commandline.h>
 #include <the_Foundation/file.h>
 #include <the_Foundation/fileinfo.h>
 #include <the_Foundation/path.h>
 #include <the_Foundation/process.h>
 #include <the_Foundation/sortedarray.h>
+#include <the_Foundation/thread.h>
 #include <the_Foundation/time.h>
 #include <SDL_events.h>
 #include <SDL_filesystem.h>
@@ -90,6 +98,16 @@ static const char *stateFileName_App_ = "state.binary";
 static const char *downloadDir_App_   = "~/Downloads";
 
 static const int idleThreshold_App_ = 1000; /* ms */
+static const int autosaveInterval_App_ = 30; /* seconds */
+
+/* Tabs that haven't been shown for a while are hibernated: their documents and media are
+   released and only a compressed copy of the source is kept. Under memory pressure, the least
+   recently shown tabs are hibernated sooner. */
+static const int    hibernateInterval_App_   = 60; /* seconds */
+static const double hibernateAfter_App_      = 15 * 60; /* seconds */
+static const size_t maxHiddenTabMemory_App_  = 128 * 1024 * 1024;
+
+iDeclareType(StateSave)
 
 struct Impl_App {
     iCommandLine args;
@@ -109,6 +127,12 @@ struct Impl_App {
     int          sleepTimer;
 #endif
     iAtomicInt   pendingRefresh;
+    int          autosaveTimer;
+    int          hibernateTimer;
+    size_t       numHibernated; /* since launch */
+    size_t       hibernatedBytes;
+    iThread *    saveThread;
+    iStateSave * save; /* being written by saveThread */
     int          tabEnum;
     iStringList *launchCommands;
     iBool        isFinishedLaunching;
@@ -188,6 +212,7 @@ static iString *serializePrefs_App_(const iApp *d) {
     appendFormat_String(str, "zoom.set arg:%d\n", d->prefs.zoomPercent);
     appendFormat_String(str, "smoothscroll arg:%d\n", d->prefs.smoothScrolling);
     appendFormat_String(str, "imageloadscroll arg:%d\n", d->prefs.loadImageInsteadOfScrolling);
+    appendFormat_String(str, "imagefetches arg:%d\n", d->prefs.maxImageFetches);
     appendFormat_String(str, "linewidth.set arg:%d\n", d->prefs.lineWidth);
     appendFormat_String(str, "prefs.biglede.changed arg:%d\n", d->prefs.bigFirstParagraph);
     appendFormat_String(str, "prefs.sideicon.changed arg:%d\n", d->prefs.sideIcon);
@@ -198,6 +223,8 @@ static iString *serializePrefs_App_(const iApp *d) {
     appendFormat_String(str, "doctheme.dark.set arg:%d\n", d->prefs.docThemeDark);
     appendFormat_String(str, "doctheme.light.set arg:%d\n", d->prefs.docThemeLight);
     appendFormat_String(str, "saturation.set arg:%d\n", (int) ((d->prefs.saturation * 100) + 0.5f));
+    appendFormat_String(str, "prefetch.count arg:%d\n", d->prefs.prefetchCount);
+    appendFormat_String(str, "prefetch.pattern pattern:%s\n", cstr_String(&d->prefs.prefetchPattern));
     appendFormat_String(str, "proxy.gemini address:%s\n", cstr_String(&d->prefs.geminiProxy));
     appendFormat_String(str, "proxy.gopher address:%s\n", cstr_String(&d->prefs.gopherProxy));
     appendFormat_String(str, "proxy.http address:%s\n", cstr_String(&d->prefs.httpProxy));
@@ -280,9 +307,10 @@ static iBool loadState_App_(iApp *d) {
             readData_File(f, 4, magic);
             if (!memcmp(magic, magicTabDocument_App_, 4)) {
                 if (!doc) {
-                    doc = newTab_App(NULL, iTrue);
+                    /* Only the current tab is switched to, so the others remain unloaded. */
+                    doc = newTab_App(NULL, iFalse);
                 }
-                if (read8_File(f)) {
+                if (read8_File(f) || !current) {
                     current = doc;
                 }
                 deserializeState_DocumentWidget(doc, stream_File(f));
@@ -310,21 +338,155 @@ iObjectList *listDocuments_App(void) {
     return docs;
 }
 
-static void saveState_App_(const iApp *d) {
+/* The state only refers to cached responses, so it is small enough to be serialized in the
+   main thread. The responses and the state file are then written in a background thread. */
+struct Impl_StateSave {
+    iBlock       state;
+    iCacheStore *store;
+    iString *    path;
+    iAtomicInt   isFinished;
+};
+
+static iStateSave *new_StateSave_(const iApp *d) {
     iUnused(d);
-    iFile *f = newCStr_File(concatPath_CStr(dataDir_App_, stateFileName_App_));
-    if (open_File(f, writeOnly_FileMode)) {
-        writeData_File(f, magicState_App_, 4);
-        writeU32_File(f, latest_FileVersion); /* version */
-        iConstForEach(ObjectList, i, iClob(listDocuments_App())) {
-            if (isInstance_Object(i.object, &Class_DocumentWidget)) {
-                writeData_File(f, magicTabDocument_App_, 4);
-                write8_File(f, document_App() == i.object ? 1 : 0);
-                serializeState_DocumentWidget(i.object, stream_File(f));
-            }
+    iStateSave *save = iMalloc(StateSave);
+    iBuffer *buf = new_Buffer();
+    openEmpty_Buffer(buf);
+    iStream *outs = stream_Buffer(buf);
+    writeData_Stream(outs, magicState_App_, 4);
+    writeU32_Stream(outs, latest_FileVersion); /* version */
+    iConstForEach(ObjectList, i, iClob(listDocuments_App())) {
+        if (isInstance_Object(i.object, &Class_DocumentWidget)) {
+            writeData_Stream(outs, magicTabDocument_App_, 4);
+            write8_Stream(outs, document_App() == i.object ? 1 : 0);
+            serializeState_DocumentWidget(i.object, outs);
         }
     }
+    initCopy_Block(&save->state, data_Buffer(buf));
+    iRelease(buf);
+    save->store = new_CacheStore(); /* after serializing, to include new references */
+    save->path  = cleanedCStr_Path(concatPath_CStr(dataDir_App_, stateFileName_App_));
+    set_Atomic(&save->isFinished, iFalse);
+    return save;
+}
+
+static void delete_StateSave_(iStateSave *d) {
+    deinit_Block(&d->state);
+    delete_CacheStore(d->store);
+    delete_String(d->path);
+    free(d);
+}
+
+static void write_StateSave_(iStateSave *d) {
+    write_CacheStore(d->store);
+    /* Replace the old state only when the new one has been completely written. */
+    iString *tempPath = new_String();
+    format_String(tempPath, "%s.tmp", cstr_String(d->path));
+    iBool isWritten = iFalse;
+    iFile *f = new_File(tempPath);
+    if (open_File(f, writeOnly_FileMode)) {
+        isWritten = writeData_File(f, constData_Block(&d->state), size_Block(&d->state)) ==
+                    size_Block(&d->state);
+    }
     iRelease(f);
+    if (isWritten) {
+#if defined (iPlatformMsys)
+        remove(cstr_String(d->path));
+#endif
+        isWritten = rename(cstr_String(tempPath), cstr_String(d->path)) == 0;
+    }
+    if (isWritten) {
+        prune_CacheStore(d->store);
+    }
+    delete_String(tempPath);
+    set_Atomic(&d->isFinished, iTrue);
+}
+
+static iThreadResult runStateSave_App_(iThread *thread) {
+    write_StateSave_(userData_Thread(thread));
+    return 0;
+}
+
+static iBool finishSave_App_(iApp *d, iBool wait) {
+    if (d->saveThread) {
+        if (!wait && !value_Atomic(&d->save->isFinished)) {
+            return iFalse;
+        }
+        join_Thread(d->saveThread);
+        iReleasePtr(&d->saveThread);
+        delete_StateSave_(d->save);
+        d->save = NULL;
+    }
+    return iTrue;
+}
+
+static void autosaveState_App_(iApp *d) {
+    if (finishSave_App_(d, iFalse)) {
+        d->save       = new_StateSave_(d);
+        d->saveThread = new_Thread(runStateSave_App_);
+        setUserData_Thread(d->saveThread, d->save);
+        start_Thread(d->saveThread);
+    }
+}
+
+static void saveState_App_(iApp *d) {
+    finishSave_App_(d, iTrue);
+    iStateSave *save = new_StateSave_(d);
+    write_StateSave_(save);
+    delete_StateSave_(save);
+}
+
+static uint32_t postAutosave_App_(uint32_t interval, void *param) {
+    iUnused(param);
+    postCommand_App("app.autosave");
+    return interval;
+}
+
+static int cmpInactiveDescending_DocumentWidget_(const void *a, const void *b) {
+    const double s = inactiveSeconds_DocumentWidget(*(const void **) a);
+    const double t = inactiveSeconds_DocumentWidget(*(const void **) b);
+    return (s < t) - (s > t);
+}
+
+static void hibernate_App_(iApp *d, iDocumentWidget *doc) {
+    const size_t released = hibernate_DocumentWidget(doc);
+    if (released) {
+        d->numHibernated++;
+        d->hibernatedBytes += released;
+    }
+}
+
+static void hibernateTabs_App_(iApp *d) {
+    iPtrArray hidden;
+    init_PtrArray(&hidden);
+    size_t hiddenSize = 0;
+    iConstForEach(ObjectList, i, iClob(listDocuments_App())) {
+        iDocumentWidget *doc = (iDocumentWidget *) i.object;
+        if (doc != document_App() && !isHibernating_DocumentWidget(doc)) {
+            pushBack_PtrArray(&hidden, doc);
+            hiddenSize += memorySize_DocumentWidget(doc);
+        }
+    }
+    sort_Array(&hidden, cmpInactiveDescending_DocumentWidget_);
+    iForEach(PtrArray, j, &hidden) {
+        iDocumentWidget *doc = j.ptr;
+        if (inactiveSeconds_DocumentWidget(doc) < hibernateAfter_App_ &&
+            hiddenSize <= maxHiddenTabMemory_App_) {
+            break;
+        }
+        const size_t size = memorySize_DocumentWidget(doc);
+        hibernate_App_(d, doc);
+        if (isHibernating_DocumentWidget(doc)) {
+            hiddenSize -= size;
+        }
+    }
+    deinit_PtrArray(&hidden);
+}
+
+static uint32_t postHibernate_App_(uint32_t interval, void *param) {
+    iUnused(param);
+    postCommand_App("app.hibernate");
+    return interval;
 }
 
 #if defined (LAGRANGE_IDLE_SLEEP)
@@ -374,6 +536,12 @@ static void init_App_(iApp *d, int argc, char **argv) {
     d->visited           = new_Visited();
     d->bookmarks         = new_Bookmarks();
     d->tabEnum           = 0; /* generates unique IDs for tab pages */
+    d->autosaveTimer     = 0;
+    d->hibernateTimer    = 0;
+    d->numHibernated     = 0;
+    d->hibernatedBytes   = 0;
+    d->saveThread        = NULL;
+    d->save              = NULL;
     setThemePalette_Color(d->prefs.theme);
 #if defined (LAGRANGE_IDLE_SLEEP)
     d->isIdling      = iFalse;
@@ -422,6 +590,13 @@ static void init_App_(iApp *d, int argc, char **argv) {
         }
     }
 #endif
+    init_Resolver();
+    initCache_History(dataDir_App_);
+    init_Prefetch();
+    init_DiskCache(dataDir_App_);
+    init_ContentIndex(dataDir_App_);
+    initConnections_GmRequest();
+    initDecoders_Media();
     d->window = new_Window(d->initialWindowRect);
     init_Feeds(dataDir_App_);
     /* Widget state init. */
@@ -429,6 +604,8 @@ static void init_App_(iApp *d, int argc, char **argv) {
     if (!loadState_App_(d)) {
         postCommand_App("navigate.home");
     }
+    d->autosaveTimer = SDL_AddTimer(1000 * autosaveInterval_App_, postAutosave_App_, d);
+    d->hibernateTimer = SDL_AddTimer(1000 * hibernateInterval_App_, postHibernate_App_, d);
     postCommand_App("window.unfreeze");
     d->isFinishedLaunching = iTrue;
     /* Run any commands that were pending completion of launch. */ {
@@ -456,6 +633,8 @@ static void init_App_(iApp *d, int argc, char **argv) {
 }
 
 static void deinit_App(iApp *d) {
+    SDL_RemoveTimer(d->autosaveTimer);
+    SDL_RemoveTimer(d->hibernateTimer);
     saveState_App_(d);
     deinit_Feeds();
     save_Keys(dataDir_App_);
@@ -472,10 +651,17 @@ static void deinit_App(iApp *d) {
     deinit_SortedArray(&d->tickers);
     delete_Window(d->window);
     d->window = NULL;
+    deinit_Prefetch();
+    deinit_ContentIndex();
+    deinit_DiskCache();
+    deinitDecoders_Media();
+    deinitConnections_GmRequest();
+    deinit_Resolver();
     deinit_CommandLine(&d->args);
     iRelease(d->launchCommands);
     delete_String(d->execPath);
     iRecycle();
+    deinitCache_History(); /* after all the tabs are gone */
 }
 
 const iString *execPath_App(void) {
@@ -504,6 +690,33 @@ const iString *debugInfo_App(void) {
     }
     appendFormat_String(msg, "## MIME hooks\n");
     append_String(msg, debugInfo_MimeHooks(d->mimehooks));
+    appendFormat_String(msg, "## Connections\n");
+    append_String(msg, debugInfo_GmRequest());
+    appendFormat_String(msg, "## History cache\n");
+    iConstForEach(ObjectList, k, iClob(listDocuments_App())) {
+        iDocumentWidget *doc = (iDocumentWidget *) k.object;
+        appendFormat_String(msg,
+                            "* %zu KB: %s\n",
+                            cacheSize_History(history_DocumentWidget(doc)) / 1024,
+                            cstr_String(url_DocumentWidget(doc)));
+    }
+    appendFormat_String(msg, "## Tab hibernation\n");
+    appendFormat_String(msg,
+                        "Hidden tabs are hibernated after %d minutes, or sooner if they use "
+                        "more than %zu MB. Hibernated since launch: %zu tabs, %zu KB released.\n",
+                        (int) (hibernateAfter_App_ / 60),
+                        maxHiddenTabMemory_App_ / (1024 * 1024),
+                        d->numHibernated,
+                        d->hibernatedBytes / 1024);
+    iConstForEach(ObjectList, m, iClob(listDocuments_App())) {
+        const iDocumentWidget *doc = (const iDocumentWidget *) m.object;
+        appendFormat_String(msg,
+                            "* %s, %zu KB, inactive %d s: %s\n",
+                            isHibernating_DocumentWidget(doc) ? "asleep" : "awake",
+                            memorySize_DocumentWidget(doc) / 1024,
+                            (int) inactiveSeconds_DocumentWidget(doc),
+                            cstr_String(url_DocumentWidget(doc)));
+    }
     return msg;
 }
 
@@ -834,8 +1047,14 @@ static iBool handlePrefsCommands_(iWidget *d, const char *cmd) {
                          isSelected_Widget(findChild_Widget(d, "prefs.smoothscroll")));
         postCommandf_App("imageloadscroll arg:%d",
                          isSelected_Widget(findChild_Widget(d, "prefs.imageloadscroll")));
+        postCommandf_App("imagefetches arg:%d",
+                         toInt_String(text_InputWidget(findChild_Widget(d, "prefs.imagefetches"))));
         postCommandf_App("ostheme arg:%d",
                          isSelected_Widget(findChild_Widget(d, "prefs.ostheme")));
+        postCommandf_App("prefetch.count arg:%d",
+                         toInt_String(text_InputWidget(findChild_Widget(d, "prefs.prefetch.count"))));
+        postCommandf_App("prefetch.pattern pattern:%s",
+                         cstr_String(text_InputWidget(findChild_Widget(d, "prefs.prefetch.pattern"))));
         postCommandf_App("proxy.gemini address:%s",
                          cstr_String(text_InputWidget(findChild_Widget(d, "prefs.proxy.gemini"))));
         postCommandf_App("proxy.gopher address:%s",
@@ -1021,6 +1240,7 @@ static iBool handleFeedSettingCommands_(iWidget *dlg, const char *cmd) {
             if (bm) {
                 set_String(&bm->title, feedTitle);
                 set_String(&bm->tags, tags);
+                reindex_Bookmarks(d->bookmarks, id);
             }
         }
         postCommand_App("bookmarks.changed");
@@ -1098,6 +1318,10 @@ iBool handleCommand_App(const char *cmd) {
         d->prefs.loadImageInsteadOfScrolling = arg_Command(cmd);
         return iTrue;
     }
+    else if (equal_Command(cmd, "imagefetches")) {
+        d->prefs.maxImageFetches = iClamp(arg_Command(cmd), 0, 8);
+        return iTrue;
+    }
     else if (equal_Command(cmd, "theme.set")) {
         const int isAuto = argLabel_Command(cmd, "auto");
         d->prefs.theme = arg_Command(cmd);
@@ -1167,6 +1391,33 @@ iBool handleCommand_App(const char *cmd) {
         postCommandf_App("theme.changed auto:1");
         return iTrue;
     }
+    else if (equal_Command(cmd, "prefetch.count")) {
+        d->prefs.prefetchCount = iClamp(arg_Command(cmd), 0, 10);
+        if (d->prefs.prefetchCount == 0) {
+            cancelAll_Prefetch();
+        }
+        return iTrue;
+    }
+    else if (equal_Command(cmd, "prefetch.pattern")) {
+        setCStr_String(&d->prefs.prefetchPattern, suffixPtr_Command(cmd, "pattern"));
+        return iTrue;
+    }
+    else if (equal_Command(cmd, "prefetch.update")) {
+        update_Prefetch();
+        return iTrue;
+    }
+    else if (equal_Command(cmd, "requests.schedule")) {
+        startQueued_GmRequest();
+        return iTrue;
+    }
+    else if (equal_Command(cmd, "app.autosave")) {
+        autosaveState_App_(d);
+        return iTrue;
+    }
+    else if (equal_Command(cmd, "app.hibernate")) {
+        hibernateTabs_App_(d);
+        return iTrue;
+    }
     else if (equal_Command(cmd, "proxy.gemini")) {
         setCStr_String(&d->prefs.geminiProxy, suffixPtr_Command(cmd, "address"));
         return iTrue;
@@ -1298,6 +1549,8 @@ iBool handleCommand_App(const char *cmd) {
         setToggle_Widget(findChild_Widget(dlg, "prefs.hoveroutline"), d->prefs.hoverOutline);
         setToggle_Widget(findChild_Widget(dlg, "prefs.smoothscroll"), d->prefs.smoothScrolling);
         setToggle_Widget(findChild_Widget(dlg, "prefs.imageloadscroll"), d->prefs.loadImageInsteadOfScrolling);
+        setText_InputWidget(findChild_Widget(dlg, "prefs.imagefetches"),
+                            collectNewFormat_String("%d", d->prefs.maxImageFetches));
         setToggle_Widget(findChild_Widget(dlg, "prefs.ostheme"), d->prefs.useSystemTheme);
         setToggle_Widget(findChild_Widget(dlg, "prefs.retainwindow"), d->prefs.retainWindowSize);
         setText_InputWidget(findChild_Widget(dlg, "prefs.uiscale"),
@@ -1332,6 +1585,9 @@ iBool handleCommand_App(const char *cmd) {
                 dlg, format_CStr("prefs.saturation.%d", (int) (d->prefs.saturation * 3.99f))),
             selected_WidgetFlag,
             iTrue);
+        setText_InputWidget(findChild_Widget(dlg, "prefs.prefetch.count"),
+                            collectNewFormat_String("%d", d->prefs.prefetchCount));
+        setText_InputWidget(findChild_Widget(dlg, "prefs.prefetch.pattern"), &d->prefs.prefetchPattern);
         setText_InputWidget(findChild_Widget(dlg, "prefs.proxy.gemini"), &d->prefs.geminiProxy);
         setText_InputWidget(findChild_Widget(dlg, "prefs.proxy.gopher"), &d->prefs.gopherProxy);
         setText_InputWidget(findChild_Widget(dlg, "prefs.proxy.http"), &d->prefs.httpProxy);
@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <the_Foundation/mutex.h>
 #include <the_Foundation/path.h>
 #include <the_Foundation/regexp.h>
+#include <the_Foundation/sortedarray.h>
 
 void init_Bookmark(iBookmark *d) {
     init_String(&d->url);
@@ -43,12 +44,13 @@ void deinit_Bookmark(iBookmark *d) {
 
 iBool hasTag_Bookmark(const iBookmark *d, const char *tag) {
     if (!d) return iFalse;
-    iRegExp *pattern = new_RegExp(format_CStr("\\b%s\\b", tag), caseSensitive_RegExpOption);
-    iRegExpMatch m;
-    init_RegExpMatch(&m);
-    const iBool found = matchString_RegExp(pattern, &d->tags, &m);
-    iRelease(pattern);
-    return found;
+    iRangecc word = iNullRange;
+    while (nextSplit_Rangecc(range_String(&d->tags), " ", &word)) {
+        if (equal_Rangecc(word, tag)) {
+            return iTrue;
+        }
+    }
+    return iFalse;
 }
 
 void addTag_Bookmark(iBookmark *d, const char *tag) {
@@ -70,14 +72,89 @@ static int cmpTimeDescending_Bookmark_(const iBookmark **a, const iBookmark **b)
     return iCmp(seconds_Time(&(*b)->when), seconds_Time(&(*a)->when));
 }
 
+static uint32_t hash_Bookmark_(iRangecc text) {
+    /* 32-bit FNV-1a. */
+    uint32_t hash = 0x811c9dc5;
+    for (const char *ch = text.start; ch != text.end; ch++) {
+        hash ^= (uint8_t) *ch;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static uint32_t urlHash_Bookmark_(const iString *url) {
+    /* URLs are compared case-insensitively. */
+    iString *lower = lower_String(url);
+    const uint32_t hash = hash_Bookmark_(range_String(lower));
+    delete_String(lower);
+    return hash;
+}
+
+/*----------------------------------------------------------------------------------------------*/
+
+iDeclareType(BookmarkKey)
+
+struct Impl_BookmarkKey {
+    uint32_t hash;
+    uint32_t id;
+};
+
+static int cmp_BookmarkKey_(const void *a, const void *b) {
+    const iBookmarkKey *k = a, *l = b;
+    if (k->hash != l->hash) {
+        return iCmp(k->hash, l->hash);
+    }
+    return iCmp(k->id, l->id);
+}
+
+/* A list of all bookmarks that is kept in sorted order as bookmarks are added, removed, and
+   edited. A view is created the first time a sort order is requested. */
+iDeclareType(BookmarksView)
+
+struct Impl_BookmarksView {
+    iBookmarksCompareFunc cmp;
+    iPtrArray             list;
+};
+
+static size_t insertPos_BookmarksView_(const iBookmarksView *d, const iBookmark *bm) {
+    size_t first = 0, last = size_PtrArray(&d->list);
+    while (first < last) {
+        const size_t     mid   = (first + last) / 2;
+        const iBookmark *other = constAt_PtrArray(&d->list, mid);
+        if (d->cmp(&other, &bm) <= 0) {
+            first = mid + 1;
+        }
+        else {
+            last = mid;
+        }
+    }
+    return first;
+}
+
+static void insert_BookmarksView_(iBookmarksView *d, const iBookmark *bm) {
+    insert_Array(&d->list, insertPos_BookmarksView_(d, bm), &bm);
+}
+
+static void remove_BookmarksView_(iBookmarksView *d, const iBookmark *bm) {
+    for (size_t i = 0; i < size_PtrArray(&d->list); i++) {
+        if (constAt_PtrArray(&d->list, i) == bm) {
+            remove_Array(&d->list, i);
+            break;
+        }
+    }
+}
+
 /*----------------------------------------------------------------------------------------------*/
 
 static const char *fileName_Bookmarks_ = "bookmarks.txt";
 
 struct Impl_Bookmarks {
-    iMutex *mtx;
-    int     idEnum;
-    iHash   bookmarks; /* bookmark ID is the hash key */
+    iMutex *     mtx;
+    int          idEnum;
+    iHash        bookmarks; /* bookmark ID is the hash key */
+    iSortedArray urls;      /* BookmarkKey: hash of the lowercase URL */
+    iSortedArray tags;      /* BookmarkKey: hash of each tag */
+    iArray       views;     /* BookmarksView */
 };
 
 iDefineTypeConstruction(Bookmarks)
@@ -86,28 +163,116 @@ void init_Bookmarks(iBookmarks *d) {
     d->mtx = new_Mutex();
     d->idEnum = 0;
     init_Hash(&d->bookmarks);
+    init_SortedArray(&d->urls, sizeof(iBookmarkKey), cmp_BookmarkKey_);
+    init_SortedArray(&d->tags, sizeof(iBookmarkKey), cmp_BookmarkKey_);
+    init_Array(&d->views, sizeof(iBookmarksView));
 }
 
 void deinit_Bookmarks(iBookmarks *d) {
     clear_Bookmarks(d);
+    deinit_Array(&d->views);
+    deinit_SortedArray(&d->tags);
+    deinit_SortedArray(&d->urls);
     deinit_Hash(&d->bookmarks);
     delete_Mutex(d->mtx);
 }
 
+static void clearViews_Bookmarks_(iBookmarks *d) {
+    iForEach(Array, i, &d->views) {
+        deinit_PtrArray(&((iBookmarksView *) i.value)->list);
+    }
+    clear_Array(&d->views);
+}
+
 void clear_Bookmarks(iBookmarks *d) {
     lock_Mutex(d->mtx);
     iForEach(Hash, i, &d->bookmarks) {
         delete_Bookmark((iBookmark *) i.value);
     }
     clear_Hash(&d->bookmarks);
+    clear_SortedArray(&d->urls);
+    clear_SortedArray(&d->tags);
+    clearViews_Bookmarks_(d);
     d->idEnum = 0;
     unlock_Mutex(d->mtx);
 }
 
+static void appendKeys_Bookmarks_(iBookmarks *d, const iBookmark *bm) {
+    /* Keys are appended unsorted; caller sorts or inserts them. */
+    const uint32_t id = id_Bookmark(bm);
+    pushBack_Array(&d->urls.values, &(iBookmarkKey){ urlHash_Bookmark_(&bm->url), id });
+    iRangecc tag = iNullRange;
+    while (nextSplit_Rangecc(range_String(&bm->tags), " ", &tag)) {
+        if (!isEmpty_Range(&tag)) {
+            pushBack_Array(&d->tags.values, &(iBookmarkKey){ hash_Bookmark_(tag), id });
+        }
+    }
+}
+
+static void sortKeys_Bookmarks_(iBookmarks *d) {
+    sort_Array(&d->urls.values, cmp_BookmarkKey_);
+    sort_Array(&d->tags.values, cmp_BookmarkKey_);
+}
+
+static void index_Bookmarks_(iBookmarks *d, const iBookmark *bm) {
+    const size_t numUrls = size_SortedArray(&d->urls);
+    const size_t numTags = size_SortedArray(&d->tags);
+    appendKeys_Bookmarks_(d, bm);
+    /* Move the new keys to their sorted positions. */
+    while (size_SortedArray(&d->urls) > numUrls) {
+        iBookmarkKey key = *(const iBookmarkKey *) back_Array(&d->urls.values);
+        popBack_Array(&d->urls.values);
+        insert_SortedArray(&d->urls, &key);
+    }
+    while (size_SortedArray(&d->tags) > numTags) {
+        iBookmarkKey key = *(const iBookmarkKey *) back_Array(&d->tags.values);
+        popBack_Array(&d->tags.values);
+        insert_SortedArray(&d->tags, &key);
+    }
+    iForEach(Array, i, &d->views) {
+        insert_BookmarksView_(i.value, bm);
+    }
+}
+
+static void removeKeys_Bookmarks_(iSortedArray *keys, uint32_t id) {
+    iForEach(Array, i, &keys->values) {
+        if (((const iBookmarkKey *) i.value)->id == id) {
+            remove_ArrayIterator(&i);
+        }
+    }
+}
+
+static void unindex_Bookmarks_(iBookmarks *d, const iBookmark *bm) {
+    /* The bookmark may have been edited after it was indexed, so the keys are found by ID. */
+    removeKeys_Bookmarks_(&d->urls, id_Bookmark(bm));
+    removeKeys_Bookmarks_(&d->tags, id_Bookmark(bm));
+    iForEach(Array, i, &d->views) {
+        remove_BookmarksView_(i.value, bm);
+    }
+}
+
+static const iBookmarksView *view_Bookmarks_(iBookmarks *d, iBookmarksCompareFunc cmp) {
+    iConstForEach(Array, i, &d->views) {
+        const iBookmarksView *view = i.value;
+        if (view->cmp == cmp) {
+            return view;
+        }
+    }
+    iBookmarksView view = { .cmp = cmp };
+    init_PtrArray(&view.list);
+    iConstForEach(Hash, j, &d->bookmarks) {
+        pushBack_PtrArray(&view.list, j.value);
+    }
+    sort_Array(&view.list, (int (*)(const void *, const void *)) cmp);
+    pushBack_Array(&d->views, &view);
+    return back_Array(&d->views);
+}
+
 static void insert_Bookmarks_(iBookmarks *d, iBookmark *bookmark) {
     lock_Mutex(d->mtx);
     bookmark->node.key = ++d->idEnum;
     insert_Hash(&d->bookmarks, &bookmark->node);
+    index_Bookmarks_(d, bookmark);
     unlock_Mutex(d->mtx);
 }
 
@@ -136,8 +301,11 @@ void load_Bookmarks(iBookmarks *d, const char *dirPath) {
             setRange_String(&bm->title, line);
             nextSplit_Rangecc(src, "\n", &line);
             setRange_String(&bm->tags, line);
-            insert_Bookmarks_(d, bm);
+            bm->node.key = ++d->idEnum;
+            insert_Hash(&d->bookmarks, &bm->node);
+            appendKeys_Bookmarks_(d, bm);
         }
+        sortKeys_Bookmarks_(d);
     }
     iRelease(f);
 }
@@ -180,6 +348,7 @@ iBool remove_Bookmarks(iBookmarks *d, uint32_t id) {
     lock_Mutex(d->mtx);
     iBookmark *bm = (iBookmark *) remove_Hash(&d->bookmarks, id);
     if (bm) {
+        unindex_Bookmarks_(d, bm);
         delete_Bookmark(bm);
     }
     unlock_Mutex(d->mtx);
@@ -190,30 +359,76 @@ iBookmark *get_Bookmarks(iBookmarks *d, uint32_t id) {
     return (iBookmark *) value_Hash(&d->bookmarks, id);
 }
 
+void reindex_Bookmarks(iBookmarks *d, uint32_t id) {
+    lock_Mutex(d->mtx);
+    const iBookmark *bm = (const iBookmark *) value_Hash(&d->bookmarks, id);
+    if (bm) {
+        unindex_Bookmarks_(d, bm);
+        index_Bookmarks_(d, bm);
+    }
+    unlock_Mutex(d->mtx);
+}
+
 iBool filterTagsRegExp_Bookmarks(void *regExp, const iBookmark *bm) {
     iRegExpMatch m;
     init_RegExpMatch(&m);
     return matchString_RegExp(regExp, &bm->tags, &m);
 }
 
-static iBool matchUrl_(void *url, const iBookmark *bm) {
-    return equalCase_String(url, &bm->url);
+static size_t firstKey_Bookmarks_(const iSortedArray *keys, uint32_t hash) {
+    size_t pos;
+    locate_SortedArray(keys, &(iBookmarkKey){ hash, 0 }, &pos);
+    return pos;
 }
 
 uint32_t findUrl_Bookmarks(const iBookmarks *d, const iString *url) {
-    /* TODO: O(n), boo */
-    const iPtrArray *found = list_Bookmarks(d, NULL, matchUrl_, (void *) url);
-    if (isEmpty_PtrArray(found)) return 0;
-    return id_Bookmark(constFront_PtrArray(found));
+    const uint32_t   hash  = urlHash_Bookmark_(url);
+    const iBookmark *found = NULL;
+    lock_Mutex(d->mtx);
+    for (size_t pos = firstKey_Bookmarks_(&d->urls, hash); pos < size_SortedArray(&d->urls); pos++) {
+        const iBookmarkKey *key = constAt_SortedArray(&d->urls, pos);
+        if (key->hash != hash) break;
+        const iBookmark *bm = (const iBookmark *) value_Hash(&d->bookmarks, key->id);
+        /* If the URL is bookmarked many times, the newest one is returned. */
+        if (bm && equalCase_String(url, &bm->url) &&
+            (!found || cmpTimeDescending_Bookmark_(&bm, &found) < 0)) {
+            found = bm;
+        }
+    }
+    unlock_Mutex(d->mtx);
+    return found ? id_Bookmark(found) : 0;
 }
 
 const iPtrArray *list_Bookmarks(const iBookmarks *d, iBookmarksCompareFunc cmp,
                                 iBookmarksFilterFunc filter, void *context) {
+    if (!cmp) cmp = cmpTimeDescending_Bookmark_;
     lock_Mutex(d->mtx);
     iPtrArray *list = collectNew_PtrArray();
-    iConstForEach(Hash, i, &d->bookmarks) {
-        const iBookmark *bm = (const iBookmark *) i.value;
-        if (!filter || filter(context, bm)) {
+    const iBookmarksView *view = view_Bookmarks_((iBookmarks *) d, cmp);
+    if (!filter) {
+        setCopy_Array(list, &view->list);
+    }
+    else {
+        iConstForEach(PtrArray, i, &view->list) {
+            if (filter(context, i.ptr)) {
+                pushBack_PtrArray(list, i.ptr);
+            }
+        }
+    }
+    unlock_Mutex(d->mtx);
+    return list;
+}
+
+const iPtrArray *listTag_Bookmarks(const iBookmarks *d, const char *tag,
+                                   iBookmarksCompareFunc cmp) {
+    const uint32_t hash = hash_Bookmark_(range_CStr(tag));
+    iPtrArray *list = collectNew_PtrArray();
+    lock_Mutex(d->mtx);
+    for (size_t pos = firstKey_Bookmarks_(&d->tags, hash); pos < size_SortedArray(&d->tags); pos++) {
+        const iBookmarkKey *key = constAt_SortedArray(&d->tags, pos);
+        if (key->hash != hash) break;
+        const iBookmark *bm = (const iBookmark *) value_Hash(&d->bookmarks, key->id);
+        if (hasTag_Bookmark(bm, tag)) {
             pushBack_PtrArray(list, bm);
         }
     }
@@ -55,7 +55,8 @@ void    save_Bookmarks      (const iBookmarks *, const char *dirPath);
 void    add_Bookmarks       (iBookmarks *, const iString *url, const iString *title, const iString *tags, iChar icon);
 iBool   remove_Bookmarks    (iBookmarks *, uint32_t id);
 iBookmark *get_Bookmarks    (iBookmarks *, uint32_t id);
-uint32_t findUrl_Bookmarks  (const iBookmarks *, const iString *url); /* O(n) */
+void    reindex_Bookmarks   (iBookmarks *, uint32_t id); /* call after editing a bookmark */
+uint32_t findUrl_Bookmarks  (const iBookmarks *, const iString *url);
 
 typedef iBool (*iBookmarksFilterFunc) (void *context, const iBookmark *);
 typedef int   (*iBookmarksCompareFunc)(const iBookmark **, const iBookmark **);
@@ -75,3 +76,13 @@ iBool   filterTagsRegExp_Bookmarks  (void *regExp, const iBookmark *);
  */
 const iPtrArray *list_Bookmarks(const iBookmarks *, iBookmarksCompareFunc cmp,
                                 iBookmarksFilterFunc filter, void *context);
+
+/**
+ * Lists the bookmarks that have a tag, using the tag index.
+ *
+ * @param cmp  Sort function. If NULL, sorted by descending creation time.
+ *
+ * @return Collected array of bookmarks.
+ */
+const iPtrArray *listTag_Bookmarks(const iBookmarks *, const char *tag,
+                                   iBookmarksCompareFunc cmp);
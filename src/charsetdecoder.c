@@ -0,0 +1,93 @@
+/* Copyright 2020 Jaakko Keränen <jaakko.keranen@iki.fi>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "charsetdecoder.h"
+
+#include <SDL_stdinc.h>
+
+struct Impl_CharsetDecoder {
+    SDL_iconv_t cd;
+    size_t      pos; /* source bytes already decoded */
+    iString     decoded;
+};
+
+void init_CharsetDecoder(iCharsetDecoder *d, const char *charset) {
+    d->cd  = SDL_iconv_open("UTF-8", charset);
+    d->pos = 0;
+    init_String(&d->decoded);
+}
+
+void deinit_CharsetDecoder(iCharsetDecoder *d) {
+    if (isValid_CharsetDecoder(d)) {
+        SDL_iconv_close(d->cd);
+    }
+    deinit_String(&d->decoded);
+}
+
+iDefineTypeConstructionArgs(CharsetDecoder, (const char *charset), charset)
+
+iBool isValid_CharsetDecoder(const iCharsetDecoder *d) {
+    return d->cd != (SDL_iconv_t) -1;
+}
+
+static void appendReplacementChar_CharsetDecoder_(iCharsetDecoder *d) {
+    appendCStr_String(&d->decoded, "\ufffd");
+}
+
+const iString *decode_CharsetDecoder(iCharsetDecoder *d, const iBlock *source, iBool isFinal) {
+    if (!isValid_CharsetDecoder(d) || d->pos > size_Block(source)) {
+        return &d->decoded;
+    }
+    const char *in     = constBegin_Block(source) + d->pos;
+    size_t      inLeft = size_Block(source) - d->pos;
+    char        buf[4096];
+    while (inLeft > 0) {
+        char * out     = buf;
+        size_t outLeft = sizeof(buf);
+        const size_t rc = SDL_iconv(d->cd, &in, &inLeft, &out, &outLeft);
+        appendData_Block(&d->decoded.chars, buf, out - buf);
+        if (rc == SDL_ICONV_E2BIG) {
+            continue; /* output buffer was full */
+        }
+        if (rc == SDL_ICONV_EILSEQ) {
+            /* Skip the invalid byte. */
+            appendReplacementChar_CharsetDecoder_(d);
+            in++;
+            inLeft--;
+            continue;
+        }
+        if (rc == SDL_ICONV_EINVAL) {
+            /* Incomplete sequence at the end; wait for the rest of it. */
+            if (isFinal) {
+                appendReplacementChar_CharsetDecoder_(d);
+                in += inLeft;
+                inLeft = 0;
+            }
+            break;
+        }
+        if (rc == SDL_ICONV_ERROR) {
+            break;
+        }
+    }
+    d->pos = in - constBegin_Block(source);
+    return &d->decoded;
+}
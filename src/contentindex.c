@@ -0,0 +1,526 @@
+/* Copyright 2020 Jaakko Keränen <jaakko.keranen@iki.fi>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+#include "contentindex.h"
+#include "defs.h"
+
+#include <the_Foundation/buffer.h>
+#include <the_Foundation/file.h>
+#include <the_Foundation/intset.h>
+#include <the_Foundation/mutex.h>
+#include <the_Foundation/path.h>
+#include <the_Foundation/ptrarray.h>
+#include <the_Foundation/sortedarray.h>
+#include <the_Foundation/thread.h>
+#include <ctype.h>
+#include <stdio.h>
+
+iDeclareType(ContentIndex)
+iDeclareType(ContentWord)
+iDeclareType(ContentPage)
+iDeclareType(ContentIndexJob)
+
+/* A search term matches the words it is a prefix of, so they can be looked up in the sorted
+   vocabulary. Words are sequences of alphanumeric characters; anything outside ASCII is
+   considered alphanumeric, too. Terms are split the same way, so a page that matches the search
+   pattern at word starts contains a word for each part. */
+struct Impl_ContentWord {
+    iString word;
+    iIntSet pages; /* IDs */
+};
+
+struct Impl_ContentPage {
+    uint32_t  id;
+    iString   url;
+    iPtrArray words; /* ContentWords of the page, in vocabulary order */
+};
+
+/* A page waiting to be indexed in the background thread. */
+struct Impl_ContentIndexJob {
+    iString url;
+    iBlock  body; /* shared with the response */
+};
+
+static const char * filename_ContentIndex_  = "content.bin";
+static const char * magic_ContentIndex_     = "lgI1";
+static const size_t maxPages_ContentIndex_  = 4000; /* oldest are removed */
+static const size_t maxUnsaved_ContentIndex_ = 10;  /* pages lost if the app crashes */
+
+struct Impl_ContentIndex {
+    iMutex *     mtx;
+    iString      path;
+    iSortedArray words; /* ContentWord pointers, by word */
+    iArray       pages; /* ContentPage; ascending IDs, so oldest first */
+    uint32_t     nextId;
+    iBool        isModified;
+    size_t       numUnsaved;
+    iCondition   jobAvailable;
+    iPtrArray    jobs;
+    iThread *    thread;
+    iBool        isStopping;
+};
+
+static iContentIndex contentIndex_;
+
+static iContentWord *new_ContentWord_(iRangecc word) {
+    iContentWord *d = iMalloc(ContentWord);
+    initRange_String(&d->word, word);
+    init_IntSet(&d->pages);
+    return d;
+}
+
+static void delete_ContentWord_(iContentWord *d) {
+    deinit_IntSet(&d->pages);
+    deinit_String(&d->word);
+    free(d);
+}
+
+static void deinit_ContentPage_(iContentPage *d) {
+    deinit_PtrArray(&d->words);
+    deinit_String(&d->url);
+}
+
+static int cmpRange_ContentIndex_(iRangecc a, iRangecc b) {
+    const size_t na = size_Range(&a), nb = size_Range(&b);
+    const int    cmp = memcmp(a.start, b.start, iMin(na, nb));
+    return cmp ? cmp : (na > nb) - (na < nb);
+}
+
+static int cmpRangePtr_ContentIndex_(const void *a, const void *b) {
+    return cmpRange_ContentIndex_(*(const iRangecc *) a, *(const iRangecc *) b);
+}
+
+static int cmp_ContentWordPtr_(const void *a, const void *b) {
+    const iContentWord * const *elem[2] = { a, b };
+    return cmpRange_ContentIndex_(range_String(&(*elem[0])->word),
+                                  range_String(&(*elem[1])->word));
+}
+
+static void delete_ContentIndexJob_(iContentIndexJob *d) {
+    deinit_Block(&d->body);
+    deinit_String(&d->url);
+    free(d);
+}
+
+static iBool isWordChar_ContentIndex_(char ch) {
+    return isalnum((unsigned char) ch) || (unsigned char) ch >= 0x80;
+}
+
+static iBool nextWord_ContentIndex_(iRangecc text, iRangecc *word) {
+    const char *pos = word->end ? word->end : text.start;
+    while (pos != text.end && !isWordChar_ContentIndex_(*pos)) {
+        pos++;
+    }
+    if (pos == text.end) {
+        return iFalse;
+    }
+    word->start = pos;
+    while (pos != text.end && isWordChar_ContentIndex_(*pos)) {
+        pos++;
+    }
+    word->end = pos;
+    return iTrue;
+}
+
+static iBool isPrefix_ContentIndex_(iRangecc prefix, const iString *word) {
+    return size_String(word) >= size_Range(&prefix) &&
+           !memcmp(constBegin_String(word), prefix.start, size_Range(&prefix));
+}
+
+static size_t locateWord_ContentIndex_(const iContentIndex *d, iRangecc word) {
+    /* Returns the position of the word, or where it would be inserted. */
+    iContentWord key;
+    initRange_String(&key.word, word);
+    const iContentWord *keyPtr = &key;
+    size_t pos;
+    locate_SortedArray(&d->words, &keyPtr, &pos);
+    deinit_String(&key.word);
+    return pos;
+}
+
+static iContentPage *findPage_ContentIndex_(iContentIndex *d, uint32_t id) {
+    /* Pages are in ascending ID order. */
+    size_t first = 0, last = size_Array(&d->pages);
+    while (first < last) {
+        const size_t  mid  = (first + last) / 2;
+        iContentPage *page = at_Array(&d->pages, mid);
+        if (page->id == id) {
+            return page;
+        }
+        if (page->id < id) {
+            first = mid + 1;
+        }
+        else {
+            last = mid;
+        }
+    }
+    return NULL;
+}
+
+static void removePage_ContentIndex_(iContentIndex *d, size_t index) {
+    /* Only the page's own words need to be updated. */
+    iContentPage *page   = at_Array(&d->pages, index);
+    iContentWord *unused = NULL; /* first one in vocabulary order */
+    iConstForEach(PtrArray, i, &page->words) {
+        iContentWord *word = (iContentWord *) i.ptr;
+        remove_IntSet(&word->pages, page->id);
+        if (!unused && isEmpty_IntSet(&word->pages)) {
+            unused = word;
+        }
+    }
+    if (unused) {
+        /* Words that are on no other page are dropped from the vocabulary in one pass,
+           starting from the first of them. */
+        iArray *vocab = &d->words.values;
+        size_t  dst   = locateWord_ContentIndex_(d, range_String(&unused->word));
+        for (size_t src = dst; src < size_Array(vocab); src++) {
+            iContentWord *word = *(iContentWord **) at_Array(vocab, src);
+            if (isEmpty_IntSet(&word->pages)) {
+                delete_ContentWord_(word);
+            }
+            else {
+                *(iContentWord **) at_Array(vocab, dst++) = word;
+            }
+        }
+        resize_Array(vocab, dst);
+    }
+    deinit_ContentPage_(page);
+    remove_Array(&d->pages, index);
+    d->isModified = iTrue;
+}
+
+static void clear_ContentIndex_(iContentIndex *d) {
+    iForEach(Array, i, &d->words.values) {
+        delete_ContentWord_(*(iContentWord **) i.value);
+    }
+    clear_SortedArray(&d->words);
+    iForEach(Array, j, &d->pages) {
+        deinit_ContentPage_(j.value);
+    }
+    clear_Array(&d->pages);
+}
+
+static iBool fitsInFile_ContentIndex_(const iFile *f, uint32_t count, size_t minItemSize) {
+    /* A corrupt count must not make the loader read past the end of the file. */
+    return count <= (size_File(f) - pos_File(f)) / minItemSize;
+}
+
+static void load_ContentIndex_(iContentIndex *d) {
+    iFile *f = new_File(&d->path);
+    if (open_File(f, readOnly_FileMode)) {
+        char magic[4];
+        readData_File(f, 4, magic);
+        const uint32_t version = readU32_File(f);
+        if (!memcmp(magic, magic_ContentIndex_, 4) && version <= latest_FileVersion) {
+            setVersion_Stream(stream_File(f), version);
+            d->nextId        = readU32_File(f);
+            uint32_t n       = readU32_File(f);
+            iBool    isValid = fitsInFile_ContentIndex_(f, n, 8);
+            for (; isValid && n > 0 && !atEnd_File(f); n--) {
+                iContentPage page;
+                page.id = readU32_File(f);
+                init_String(&page.url);
+                init_PtrArray(&page.words);
+                deserialize_String(&page.url, stream_File(f));
+                isValid = page.id < d->nextId &&
+                          (isEmpty_Array(&d->pages) ||
+                           page.id > ((const iContentPage *) back_Array(&d->pages))->id);
+                pushBack_Array(&d->pages, &page);
+            }
+            /* Words were saved in order, so they can be appended. The pages' word lists get
+               built in the same order. */
+            n = isValid ? readU32_File(f) : 0;
+            isValid = isValid && fitsInFile_ContentIndex_(f, n, 8);
+            for (; isValid && n > 0 && !atEnd_File(f); n--) {
+                iContentWord *word = new_ContentWord_(iNullRange);
+                deserialize_String(&word->word, stream_File(f));
+                uint32_t count = readU32_File(f);
+                isValid = fitsInFile_ContentIndex_(f, count, 4) &&
+                          (isEmpty_SortedArray(&d->words) ||
+                           cmp_ContentWordPtr_(back_Array(&d->words.values), &word) < 0);
+                for (; isValid && count > 0 && !atEnd_File(f); count--) {
+                    const uint32_t id   = readU32_File(f);
+                    iContentPage * page = findPage_ContentIndex_(d, id);
+                    if (page && !contains_IntSet(&word->pages, id)) {
+                        insert_IntSet(&word->pages, id);
+                        pushBack_PtrArray(&page->words, word);
+                    }
+                }
+                if (isEmpty_IntSet(&word->pages)) {
+                    delete_ContentWord_(word);
+                    continue;
+                }
+                pushBack_Array(&d->words.values, &word);
+            }
+            if (!isValid) {
+                clear_ContentIndex_(d); /* corrupt; pages will be indexed again */
+                d->nextId = 1;
+            }
+        }
+    }
+    iRelease(f);
+}
+
+static void serialize_ContentIndex_(const iContentIndex *d, iStream *outs) {
+    writeData_Stream(outs, magic_ContentIndex_, 4);
+    writeU32_Stream(outs, latest_FileVersion);
+    writeU32_Stream(outs, d->nextId);
+    writeU32_Stream(outs, size_Array(&d->pages));
+    iConstForEach(Array, i, &d->pages) {
+        const iContentPage *page = i.value;
+        writeU32_Stream(outs, page->id);
+        serialize_String(&page->url, outs);
+    }
+    writeU32_Stream(outs, size_SortedArray(&d->words));
+    iConstForEach(Array, j, &d->words.values) {
+        const iContentWord *word = *(const iContentWord **) j.value;
+        serialize_String(&word->word, outs);
+        writeU32_Stream(outs, size_IntSet(&word->pages));
+        iConstForEach(IntSet, k, &word->pages) {
+            writeU32_Stream(outs, *k.value);
+        }
+    }
+}
+
+static void save_ContentIndex_(iContentIndex *d) {
+    /* Searches only need to wait while the index is serialized in memory. */
+    iBuffer *buf = new_Buffer();
+    openEmpty_Buffer(buf);
+    iGuardMutex(d->mtx, {
+        serialize_ContentIndex_(d, stream_Buffer(buf));
+        d->isModified = iFalse;
+        d->numUnsaved = 0;
+    });
+    /* Replace the old index only when the new one has been completely written. */
+    iString *tempPath = new_String();
+    format_String(tempPath, "%s.tmp", cstr_String(&d->path));
+    iBool isWritten = iFalse;
+    iFile *f = new_File(tempPath);
+    if (open_File(f, writeOnly_FileMode)) {
+        isWritten = writeData_File(f, constData_Block(data_Buffer(buf)),
+                                   size_Block(data_Buffer(buf))) == size_Block(data_Buffer(buf));
+    }
+    iRelease(f);
+    iRelease(buf);
+    if (isWritten) {
+#if defined (iPlatformMsys)
+        remove(cstr_String(&d->path));
+#endif
+        rename(cstr_String(tempPath), cstr_String(&d->path));
+    }
+    delete_String(tempPath);
+}
+
+/* Returns True if the index should be saved. */
+static iBool index_ContentIndex_(iContentIndex *d, const iContentIndexJob *job) {
+    /* Matching is case-insensitive. The words of the page are found before locking, so
+       searches aren't held up. */
+    iString *text  = newBlock_String(&job->body);
+    iString *lower = lower_String(text);
+    delete_String(text);
+    iArray words;
+    init_Array(&words, sizeof(iRangecc));
+    iRangecc word = iNullRange;
+    while (nextWord_ContentIndex_(range_String(lower), &word)) {
+        pushBack_Array(&words, &word);
+    }
+    sort_Array(&words, cmpRangePtr_ContentIndex_);
+    lock_Mutex(d->mtx);
+    iConstForEach(Array, i, &d->pages) {
+        if (equal_String(&((const iContentPage *) i.value)->url, &job->url)) {
+            removePage_ContentIndex_(d, index_ArrayConstIterator(&i));
+            break;
+        }
+    }
+    while (size_Array(&d->pages) >= maxPages_ContentIndex_) {
+        removePage_ContentIndex_(d, 0);
+    }
+    iContentPage page = { .id = d->nextId++ };
+    initCopy_String(&page.url, &job->url);
+    init_PtrArray(&page.words);
+    /* Both lists are sorted, so they can be merged in one pass. */
+    const iArray *vocab = &d->words.values;
+    iArray        merged;
+    init_Array(&merged, sizeof(iContentWord *));
+    size_t          pos  = 0;
+    const iRangecc *prev = NULL;
+    iConstForEach(Array, j, &words) {
+        const iRangecc *w = j.value;
+        if (prev && !cmpRange_ContentIndex_(*prev, *w)) {
+            continue; /* same word again */
+        }
+        prev = w;
+        int cmp = -1;
+        while (pos < size_Array(vocab) &&
+               (cmp = cmpRange_ContentIndex_(
+                    range_String(&(*(iContentWord **) constAt_Array(vocab, pos))->word), *w)) < 0) {
+            pushBack_Array(&merged, constAt_Array(vocab, pos++));
+        }
+        iContentWord *entry;
+        if (pos < size_Array(vocab) && cmp == 0) {
+            entry = *(iContentWord **) constAt_Array(vocab, pos++);
+        }
+        else {
+            entry = new_ContentWord_(*w);
+        }
+        insert_IntSet(&entry->pages, page.id);
+        pushBack_Array(&merged, &entry);
+        pushBack_PtrArray(&page.words, entry);
+    }
+    while (pos < size_Array(vocab)) {
+        pushBack_Array(&merged, constAt_Array(vocab, pos++));
+    }
+    deinit_Array(&d->words.values);
+    d->words.values = merged;
+    pushBack_Array(&d->pages, &page);
+    d->isModified = iTrue;
+    const iBool isSaveDue = ++d->numUnsaved >= maxUnsaved_ContentIndex_;
+    unlock_Mutex(d->mtx);
+    deinit_Array(&words);
+    delete_String(lower);
+    return isSaveDue;
+}
+
+static iThreadResult run_ContentIndex_(iThread *thread) {
+    iContentIndex *d = &contentIndex_;
+    iUnused(thread);
+    lock_Mutex(d->mtx);
+    for (;;) {
+        if (isEmpty_PtrArray(&d->jobs)) {
+            if (d->isStopping) {
+                break;
+            }
+            wait_Condition(&d->jobAvailable, d->mtx);
+            continue;
+        }
+        iContentIndexJob *job;
+        take_PtrArray(&d->jobs, 0, (void **) &job);
+        unlock_Mutex(d->mtx);
+        if (index_ContentIndex_(d, job)) {
+            save_ContentIndex_(d);
+        }
+        delete_ContentIndexJob_(job);
+        lock_Mutex(d->mtx);
+    }
+    unlock_Mutex(d->mtx);
+    return 0;
+}
+
+void init_ContentIndex(const char *saveDir) {
+    iContentIndex *d = &contentIndex_;
+    d->mtx = new_Mutex();
+    const char *dir = concatPath_CStr(saveDir, "cache");
+    makeDirs_Path(collectNewCStr_String(dir));
+    initCStr_String(&d->path, concatPath_CStr(dir, filename_ContentIndex_));
+    init_SortedArray(&d->words, sizeof(iContentWord *), cmp_ContentWordPtr_);
+    init_Array(&d->pages, sizeof(iContentPage));
+    d->nextId     = 1;
+    d->isModified = iFalse;
+    d->numUnsaved = 0;
+    load_ContentIndex_(d);
+    init_Condition(&d->jobAvailable);
+    init_PtrArray(&d->jobs);
+    d->isStopping = iFalse;
+    d->thread     = new_Thread(run_ContentIndex_);
+    start_Thread(d->thread);
+}
+
+void deinit_ContentIndex(void) {
+    iContentIndex *d = &contentIndex_;
+    iGuardMutex(d->mtx, {
+        d->isStopping = iTrue; /* the queued pages are indexed first */
+        signal_Condition(&d->jobAvailable);
+    });
+    join_Thread(d->thread);
+    iRelease(d->thread);
+    deinit_PtrArray(&d->jobs);
+    deinit_Condition(&d->jobAvailable);
+    if (d->isModified) {
+        save_ContentIndex_(d);
+    }
+    clear_ContentIndex_(d);
+    deinit_SortedArray(&d->words);
+    deinit_Array(&d->pages);
+    deinit_String(&d->path);
+    delete_Mutex(d->mtx);
+}
+
+void add_ContentIndex(const iString *url, const iString *mime, const iBlock *body) {
+    iContentIndex *d = &contentIndex_;
+    if (!startsWithCase_String(mime, "text/")) {
+        return;
+    }
+    iContentIndexJob *job = iMalloc(ContentIndexJob);
+    initCopy_String(&job->url, url);
+    initCopy_Block(&job->body, body);
+    iGuardMutex(d->mtx, {
+        pushBack_PtrArray(&d->jobs, job);
+        signal_Condition(&d->jobAvailable);
+    });
+}
+
+iStringArray *query_ContentIndex(const iString *terms) {
+    iContentIndex *d = &contentIndex_;
+    iString *lower = lower_String(terms);
+    iIntSet *found = NULL;
+    lock_Mutex(d->mtx);
+    iRangecc term = iNullRange;
+    while (nextWord_ContentIndex_(range_String(lower), &term)) {
+        /* Pages that have a word starting with the term. In the sorted vocabulary, these
+           words come right after each other. */
+        iIntSet *matching = new_IntSet();
+        for (size_t pos = locateWord_ContentIndex_(d, term); pos < size_SortedArray(&d->words);
+             pos++) {
+            const iContentWord *word = *(const iContentWord **) constAt_Array(&d->words.values, pos);
+            if (!isPrefix_ContentIndex_(term, &word->word)) {
+                break;
+            }
+            iConstForEach(IntSet, j, &word->pages) {
+                if (!found || contains_IntSet(found, *j.value)) {
+                    insert_IntSet(matching, *j.value);
+                }
+            }
+        }
+        if (found) {
+            delete_IntSet(found);
+        }
+        found = matching;
+        if (isEmpty_IntSet(found)) {
+            break;
+        }
+    }
+    iStringArray *urls = NULL;
+    if (found) {
+        urls = new_StringArray();
+        iConstForEach(Array, i, &d->pages) {
+            const iContentPage *page = i.value;
+            if (contains_IntSet(found, page->id)) {
+                pushBack_StringArray(urls, &page->url);
+            }
+        }
+    }
+    unlock_Mutex(d->mtx);
+    if (found) {
+        delete_IntSet(found);
+    }
+    delete_String(lower);
+    return urls;
+}
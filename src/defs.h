@@ -25,8 +25,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 enum iFileVersion {
     initial_FileVersion                 = 0,
     addedResponseTimestamps_FileVersion = 1,
+    sessionResponseFiles_FileVersion    = 2,
+    addedTabTitles_FileVersion          = 3,
     /* meta */
-    latest_FileVersion = 1
+    latest_FileVersion = 3
 };
 
 /* Icons */
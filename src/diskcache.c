@@ -0,0 +1,542 @@
+/* Copyright 2020 Jaakko Keränen <jaakko.keranen@iki.fi>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "diskcache.h"
+#include "gmcerts.h"
+#include "app.h"
+#include "defs.h"
+
+#include <the_Foundation/buffer.h>
+#include <the_Foundation/file.h>
+#include <the_Foundation/fileinfo.h>
+#include <the_Foundation/mutex.h>
+#include <the_Foundation/path.h>
+#include <the_Foundation/ptrarray.h>
+#include <the_Foundation/sortedarray.h>
+#include <the_Foundation/thread.h>
+#include <stdio.h>
+
+iDeclareType(DiskCache)
+iDeclareType(DiskCacheEntry)
+iDeclareType(DiskCacheWrite)
+
+struct Impl_DiskCacheEntry {
+    uint64_t key;
+    size_t   size;     /* bytes on disk */
+    uint64_t lastUsed; /* seconds since the epoch */
+};
+
+/* A response waiting to be written by the background thread. */
+struct Impl_DiskCacheWrite {
+    uint64_t     key;
+    iString      url;
+    iBlock       fingerprint;
+    iGmResponse *response;
+};
+
+enum iDiskCacheEntryFlag {
+    compressedBody_DiskCacheEntryFlag = iBit(1),
+};
+
+static const char *   indexFilename_DiskCache_ = "index.txt";
+static const char *   magic_DiskCache_         = "lgC2";
+static const size_t   maxEntrySize_DiskCache_  = 4 * 1024 * 1024;
+static const size_t   maxTotalSize_DiskCache_  = 64 * 1024 * 1024;
+static const size_t   maxUnsaved_DiskCache_    = 16; /* writes before the index is saved */
+
+/* Note: The background thread and the lookup thread also use the cache, so nothing may be
+   collected here. */
+struct Impl_DiskCache {
+    iMutex *          mtx;
+    iString           dir;
+    iString           indexPath;
+    iSortedArray      entries; /* DiskCacheEntry, by key */
+    size_t            totalSize;
+    iBool             isModified;
+    size_t            numUnsaved;
+    iCondition        writeAvailable;
+    iPtrArray         writes;  /* queued DiskCacheWrites */
+    iDiskCacheWrite * writing; /* being written right now */
+    iThread *         writer;
+    iBool             isStopping;
+};
+
+static iDiskCache diskCache_;
+
+static void delete_DiskCacheWrite_(iDiskCacheWrite *d) {
+    deinit_String(&d->url);
+    deinit_Block(&d->fingerprint);
+    delete_GmResponse(d->response);
+    free(d);
+}
+
+static void identityFingerprint_DiskCache_(const iString *url, iBlock *fingerprint_out) {
+    const iGmIdentity *ident = identityForUrl_GmCerts(certs_App(), url);
+    if (ident) {
+        set_Block(fingerprint_out, &ident->fingerprint);
+    }
+    else {
+        clear_Block(fingerprint_out);
+    }
+}
+
+static uint64_t key_DiskCache_(const iString *url, const iBlock *fingerprint) {
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const iRangecc ranges[2] = { range_String(url), range_Block(fingerprint) };
+    iForIndices(r, ranges) {
+        for (const char *ch = ranges[r].start; ch != ranges[r].end; ch++) {
+            hash ^= (uint8_t) *ch;
+            hash *= 0x100000001b3ull;
+        }
+    }
+    return hash;
+}
+
+static uint64_t now_DiskCache_(void) {
+    iTime now;
+    initCurrent_Time(&now);
+    return now.ts.tv_sec;
+}
+
+static iString *entryPath_DiskCache_(const iDiskCache *d, uint64_t key, const char *ext) {
+    iString *name = newFormat_String("%016llx.%s", (unsigned long long) key, ext);
+    iString *path = concat_Path(&d->dir, name);
+    delete_String(name);
+    return path;
+}
+
+static int cmpKey_DiskCacheEntry_(const void *a, const void *b) {
+    const uint64_t x = ((const iDiskCacheEntry *) a)->key;
+    const uint64_t y = ((const iDiskCacheEntry *) b)->key;
+    return (x > y) - (x < y);
+}
+
+static int cmpLastUsed_DiskCacheEntry_(const void *a, const void *b) {
+    const uint64_t x = ((const iDiskCacheEntry *) a)->lastUsed;
+    const uint64_t y = ((const iDiskCacheEntry *) b)->lastUsed;
+    return (x > y) - (x < y);
+}
+
+static size_t find_DiskCache_(const iDiskCache *d, uint64_t key) {
+    size_t pos;
+    if (locate_SortedArray(&d->entries, &(iDiskCacheEntry){ .key = key }, &pos)) {
+        return pos;
+    }
+    return iInvalidPos;
+}
+
+static iDiskCacheEntry *at_DiskCache_(iDiskCache *d, size_t index) {
+    return at_SortedArray(&d->entries, index);
+}
+
+static void forgetEntry_DiskCache_(iDiskCache *d, size_t index) {
+    d->totalSize -= at_DiskCache_(d, index)->size;
+    remove_Array(&d->entries.values, index);
+    d->isModified = iTrue;
+}
+
+static void removeEntry_DiskCache_(iDiskCache *d, size_t index) {
+    iString *path = entryPath_DiskCache_(d, at_DiskCache_(d, index)->key, "bin");
+    remove(cstr_String(path));
+    delete_String(path);
+    forgetEntry_DiskCache_(d, index);
+}
+
+static void evict_DiskCache_(iDiskCache *d) {
+    if (d->totalSize <= maxTotalSize_DiskCache_) {
+        return;
+    }
+    /* The least recently used entries are removed until the rest fit in the budget. */
+    iArray byAge;
+    initCopy_Array(&byAge, &d->entries.values);
+    sort_Array(&byAge, cmpLastUsed_DiskCacheEntry_);
+    iConstForEach(Array, i, &byAge) {
+        if (d->totalSize <= maxTotalSize_DiskCache_) {
+            break;
+        }
+        removeEntry_DiskCache_(d, find_DiskCache_(d, ((const iDiskCacheEntry *) i.value)->key));
+    }
+    deinit_Array(&byAge);
+}
+
+static void load_DiskCache_(iDiskCache *d) {
+    iFile *f = new_File(&d->indexPath);
+    if (open_File(f, readOnly_FileMode | text_FileMode)) {
+        const iRangecc src  = range_Block(collect_Block(readAll_File(f)));
+        iRangecc       line = iNullRange;
+        while (nextSplit_Rangecc(src, "\n", &line)) {
+            unsigned long long key, size, lastUsed;
+            if (sscanf(cstr_Rangecc(line), "%llx %llu %llu", &key, &size, &lastUsed) == 3) {
+                const iDiskCacheEntry entry = { .key = key, .size = size, .lastUsed = lastUsed };
+                insert_SortedArray(&d->entries, &entry);
+            }
+        }
+    }
+    iRelease(f);
+}
+
+static void reconcile_DiskCache_(iDiskCache *d) {
+    /* The index is only saved now and then, so it may be out of date. Files that are missing
+       from the index were written after the last save; their modification time is used as the
+       time of last use. */
+    iArray found;
+    init_Array(&found, sizeof(iDiskCacheEntry));
+    iFileInfo *   info = new_FileInfo(&d->dir);
+    iDirFileInfo *dir  = directoryContents_FileInfo(info);
+    iForEach(DirFileInfo, i, dir) {
+        const iFileInfo *  entry = i.value;
+        const iRangecc     name  = baseName_Path(path_FileInfo(entry));
+        unsigned long long key;
+        char               ext[4];
+        if (size_Range(&name) == 20 &&
+            sscanf(name.start, "%16llx.%3s", &key, ext) == 2) {
+            if (!iCmpStr(ext, "tmp")) {
+                remove(cstr_String(path_FileInfo(entry))); /* unfinished write */
+            }
+            else if (!iCmpStr(ext, "bin")) {
+                const iDiskCacheEntry file = {
+                    .key      = key,
+                    .size     = size_FileInfo(entry),
+                    .lastUsed = lastModified_FileInfo(entry).ts.tv_sec,
+                };
+                pushBack_Array(&found, &file);
+            }
+        }
+    }
+    iRelease(dir);
+    iRelease(info);
+    /* Indexed entries whose file is missing are dropped. */
+    iSortedArray entries;
+    init_SortedArray(&entries, sizeof(iDiskCacheEntry), cmpKey_DiskCacheEntry_);
+    d->totalSize = 0;
+    iConstForEach(Array, j, &found) {
+        iDiskCacheEntry file  = *(const iDiskCacheEntry *) j.value;
+        const size_t    index = find_DiskCache_(d, file.key);
+        if (index != iInvalidPos) {
+            file.lastUsed = at_DiskCache_(d, index)->lastUsed;
+        }
+        insert_SortedArray(&entries, &file);
+        d->totalSize += file.size;
+    }
+    deinit_SortedArray(&d->entries);
+    d->entries = entries;
+    deinit_Array(&found);
+}
+
+static void save_DiskCache_(iDiskCache *d) {
+    /* The index is formatted under the lock and written without it. */
+    iBlock * data = new_Block(0);
+    iString *line = new_String();
+    lock_Mutex(d->mtx);
+    iConstForEach(Array, i, &d->entries.values) {
+        const iDiskCacheEntry *entry = i.value;
+        format_String(line,
+                      "%016llx %llu %llu\n",
+                      (unsigned long long) entry->key,
+                      (unsigned long long) entry->size,
+                      (unsigned long long) entry->lastUsed);
+        append_Block(data, &line->chars);
+    }
+    d->isModified = iFalse;
+    d->numUnsaved = 0;
+    unlock_Mutex(d->mtx);
+    delete_String(line);
+    /* Replace the old index only when the new one has been completely written. */
+    iString *tempPath = newFormat_String("%s.tmp", cstr_String(&d->indexPath));
+    iBool    isWritten = iFalse;
+    iFile *  f = new_File(tempPath);
+    if (open_File(f, writeOnly_FileMode | text_FileMode)) {
+        isWritten = writeData_File(f, constData_Block(data), size_Block(data)) == size_Block(data);
+    }
+    iRelease(f);
+    delete_Block(data);
+    if (isWritten) {
+#if defined (iPlatformMsys)
+        remove(cstr_String(&d->indexPath));
+#endif
+        rename(cstr_String(tempPath), cstr_String(&d->indexPath));
+    }
+    delete_String(tempPath);
+}
+
+static iBlock *serialize_DiskCacheWrite_(const iDiskCacheWrite *d) {
+    iBuffer *buf = new_Buffer();
+    openEmpty_Buffer(buf);
+    iStream *outs = stream_Buffer(buf);
+    writeData_Stream(outs, magic_DiskCache_, 4);
+    writeU32_Stream(outs, latest_FileVersion);
+    serialize_String(&d->url, outs);
+    serialize_Block(&d->fingerprint, outs);
+    const iGmResponse *resp  = d->response;
+    int                flags = 0;
+#if defined (iHaveZlib)
+    iGmResponse *zipped = NULL;
+    iBlock *     body   = compress_Block(&resp->body);
+    if (size_Block(body) < size_Block(&resp->body) * 9 / 10) {
+        zipped = copy_GmResponse(resp);
+        set_Block(&zipped->body, body);
+        resp = zipped;
+        flags |= compressedBody_DiskCacheEntryFlag;
+    }
+    delete_Block(body);
+#endif
+    write8_Stream(outs, flags);
+    serialize_GmResponse(resp, outs);
+#if defined (iHaveZlib)
+    if (zipped) {
+        delete_GmResponse(zipped);
+    }
+#endif
+    iBlock *data = copy_Block(data_Buffer(buf));
+    iRelease(buf);
+    return data;
+}
+
+static void write_DiskCache_(iDiskCache *d, const iDiskCacheWrite *job) {
+    /* The entry is written to a temporary file first so readers never see a partial one.
+       It is prepared in memory, so a short write can be detected. */
+    iBlock * data = serialize_DiskCacheWrite_(job);
+    iString *tempPath = entryPath_DiskCache_(d, job->key, "tmp");
+    iBool    isWritten = iFalse;
+    const size_t size = size_Block(data);
+    iFile *  f = new_File(tempPath);
+    if (open_File(f, writeOnly_FileMode)) {
+        isWritten = writeData_File(f, constData_Block(data), size) == size;
+    }
+    iRelease(f);
+    delete_Block(data);
+    iString *path = entryPath_DiskCache_(d, job->key, "bin");
+    lock_Mutex(d->mtx);
+    const size_t existing = find_DiskCache_(d, job->key);
+    if (existing != iInvalidPos) {
+        forgetEntry_DiskCache_(d, existing);
+    }
+    if (isWritten) {
+#if defined (iPlatformMsys)
+        remove(cstr_String(path));
+#endif
+        isWritten = rename(cstr_String(tempPath), cstr_String(path)) == 0;
+    }
+    if (isWritten) {
+        const iDiskCacheEntry entry = { .key = job->key, .size = size, .lastUsed = now_DiskCache_() };
+        insert_SortedArray(&d->entries, &entry);
+        d->totalSize += entry.size;
+        d->isModified = iTrue;
+        evict_DiskCache_(d);
+    }
+    else {
+        remove(cstr_String(tempPath));
+        remove(cstr_String(path));
+    }
+    d->numUnsaved++;
+    unlock_Mutex(d->mtx);
+    delete_String(path);
+    delete_String(tempPath);
+}
+
+static iThreadResult run_DiskCache_(iThread *thread) {
+    iDiskCache *d = &diskCache_;
+    iUnused(thread);
+    lock_Mutex(d->mtx);
+    for (;;) {
+        if (isEmpty_PtrArray(&d->writes)) {
+            if (d->isStopping) {
+                break; /* all pending writes are done */
+            }
+            wait_Condition(&d->writeAvailable, d->mtx);
+            continue;
+        }
+        take_PtrArray(&d->writes, 0, (void **) &d->writing);
+        unlock_Mutex(d->mtx);
+        write_DiskCache_(d, d->writing);
+        if (d->numUnsaved >= maxUnsaved_DiskCache_) {
+            /* Entries written since the last save are found again at launch. */
+            save_DiskCache_(d);
+        }
+        lock_Mutex(d->mtx);
+        delete_DiskCacheWrite_(d->writing);
+        d->writing = NULL;
+    }
+    unlock_Mutex(d->mtx);
+    return 0;
+}
+
+static const iDiskCacheWrite *findWrite_DiskCache_(const iDiskCache *d, uint64_t key,
+                                                   size_t *index_out) {
+    if (d->writing && d->writing->key == key) {
+        *index_out = iInvalidPos;
+        return d->writing;
+    }
+    for (size_t i = 0; i < size_PtrArray(&d->writes); i++) {
+        const iDiskCacheWrite *job = constAt_PtrArray(&d->writes, i);
+        if (job->key == key) {
+            *index_out = i;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void init_DiskCache(const char *saveDir) {
+    iDiskCache *d = &diskCache_;
+    d->mtx = new_Mutex();
+    initCStr_String(&d->dir, concatPath_CStr(saveDir, "cache"));
+    initCStr_String(&d->indexPath, concatPath_CStr(cstr_String(&d->dir), indexFilename_DiskCache_));
+    init_SortedArray(&d->entries, sizeof(iDiskCacheEntry), cmpKey_DiskCacheEntry_);
+    d->totalSize  = 0;
+    d->isModified = iFalse;
+    d->numUnsaved = 0;
+    makeDirs_Path(&d->dir);
+    load_DiskCache_(d);
+    reconcile_DiskCache_(d);
+    evict_DiskCache_(d);
+    init_Condition(&d->writeAvailable);
+    init_PtrArray(&d->writes);
+    d->writing    = NULL;
+    d->isStopping = iFalse;
+    d->writer     = new_Thread(run_DiskCache_);
+    start_Thread(d->writer);
+}
+
+void deinit_DiskCache(void) {
+    iDiskCache *d = &diskCache_;
+    iGuardMutex(d->mtx, {
+        d->isStopping = iTrue;
+        signal_Condition(&d->writeAvailable);
+    });
+    join_Thread(d->writer);
+    iRelease(d->writer);
+    deinit_PtrArray(&d->writes);
+    deinit_Condition(&d->writeAvailable);
+    if (d->isModified) {
+        save_DiskCache_(d);
+    }
+    deinit_SortedArray(&d->entries);
+    deinit_String(&d->indexPath);
+    deinit_String(&d->dir);
+    delete_Mutex(d->mtx);
+}
+
+void store_DiskCache(const iString *url, const iGmResponse *response) {
+    iDiskCache *d = &diskCache_;
+    if (!isSuccess_GmStatusCode(response->statusCode) ||
+        size_Block(&response->body) > maxEntrySize_DiskCache_) {
+        return;
+    }
+    iDiskCacheWrite *job = iMalloc(DiskCacheWrite);
+    initCopy_String(&job->url, url);
+    init_Block(&job->fingerprint, 0);
+    identityFingerprint_DiskCache_(url, &job->fingerprint);
+    job->key      = key_DiskCache_(url, &job->fingerprint);
+    job->response = copy_GmResponse(response); /* body is shared, not copied */
+    iGuardMutex(d->mtx, {
+        /* An older response for the same page doesn't need to be written any more. */
+        size_t index;
+        if (findWrite_DiskCache_(d, job->key, &index) && index != iInvalidPos) {
+            iDiskCacheWrite *old;
+            take_PtrArray(&d->writes, index, (void **) &old);
+            delete_DiskCacheWrite_(old);
+        }
+        pushBack_PtrArray(&d->writes, job);
+        signal_Condition(&d->writeAvailable);
+    });
+}
+
+static iGmResponse *read_DiskCache_(const iDiskCache *d, uint64_t key, const iString *url,
+                                    const iBlock *fingerprint) {
+    iGmResponse *resp = NULL;
+    iString *    path = entryPath_DiskCache_(d, key, "bin");
+    iFile *      f    = new_File(path);
+    if (open_File(f, readOnly_FileMode)) {
+        char magic[4];
+        readData_File(f, 4, magic);
+        const uint32_t version = readU32_File(f);
+        if (!memcmp(magic, magic_DiskCache_, 4) && version <= latest_FileVersion) {
+            setVersion_Stream(stream_File(f), version);
+            iString *entryUrl = new_String();
+            iBlock * entryFingerprint = new_Block(0);
+            deserialize_String(entryUrl, stream_File(f));
+            deserialize_Block(entryFingerprint, stream_File(f));
+            /* Different URLs may have the same key. */
+            if (equal_String(entryUrl, url) && !cmp_Block(entryFingerprint, fingerprint)) {
+                const int flags = read8_File(f);
+                resp = new_GmResponse();
+                deserialize_GmResponse(resp, stream_File(f));
+                if (flags & compressedBody_DiskCacheEntryFlag) {
+#if defined (iHaveZlib)
+                    iBlock *body = decompress_Block(&resp->body);
+                    set_Block(&resp->body, body);
+                    delete_Block(body);
+#else
+                    delete_GmResponse(resp); /* can't be read in this build */
+                    resp = NULL;
+#endif
+                }
+            }
+            delete_Block(entryFingerprint);
+            delete_String(entryUrl);
+        }
+    }
+    iRelease(f);
+    delete_String(path);
+    return resp;
+}
+
+iGmResponse *load_DiskCache(const iString *url) {
+    iDiskCache *d = &diskCache_;
+    iGmResponse *resp = NULL;
+    iBool isIndexed = iFalse;
+    iBlock fingerprint;
+    init_Block(&fingerprint, 0);
+    identityFingerprint_DiskCache_(url, &fingerprint);
+    const uint64_t key = key_DiskCache_(url, &fingerprint);
+    iGuardMutex(d->mtx, {
+        /* A response that hasn't been written yet is the most recent one. */
+        size_t index;
+        const iDiskCacheWrite *pending = findWrite_DiskCache_(d, key, &index);
+        if (pending && equal_String(&pending->url, url)) {
+            resp = copy_GmResponse(pending->response);
+        }
+        else {
+            isIndexed = find_DiskCache_(d, key) != iInvalidPos;
+        }
+    });
+    if (isIndexed) {
+        /* Files are replaced atomically, so reading doesn't need to block the writer. */
+        resp = read_DiskCache_(d, key, url, &fingerprint);
+        iGuardMutex(d->mtx, {
+            const size_t index = find_DiskCache_(d, key);
+            if (index != iInvalidPos) {
+                if (resp) {
+                    at_DiskCache_(d, index)->lastUsed = now_DiskCache_();
+                    d->isModified = iTrue;
+                }
+                else {
+                    removeEntry_DiskCache_(d, index);
+                }
+            }
+        });
+    }
+    deinit_Block(&fingerprint);
+    return resp;
+}
@@ -67,15 +67,15 @@ const iString *url_FeedEntry(const iFeedEntry *d) {
 
 iBool isUnread_FeedEntry(const iFeedEntry *d) {
     const size_t fragPos = indexOf_String(&d->url, '#');
+    iRangecc     url     = range_String(&d->url);
     if (fragPos != iInvalidPos) {
         /* Check if the entry is newer than the latest visit. */
-        const iTime visTime = urlVisitTime_Visited(visited_App(), url_FeedEntry(d));
+        url.end = url.start + fragPos;
+        const iTime visTime = visitTime_Visited(visited_App(), url, urlHash_Visited(url));
         return cmp_Time(&visTime, &d->posted) < 0;
     }
-    if (!containsUrl_Visited(visited_App(), &d->url)) {
-        return iTrue;
-    }
-    return iFalse;
+    const iTime visTime = visitTime_Visited(visited_App(), url, urlHash_Visited(url));
+    return !isValid_Time(&visTime);
 }
 
 /*----------------------------------------------------------------------------------------------*/
@@ -135,23 +135,13 @@ static iFeeds feeds_;
 static void submit_FeedJob_(iFeedJob *d) {
     d->request = new_GmRequest(certs_App());
     setUrl_GmRequest(d->request, &d->url);
+    setPriority_GmRequest(d->request, background_GmRequestPriority);
     initCurrent_Time(&d->startTime);
     submit_GmRequest(d->request);
 }
 
-static iBool isSubscribed_(void *context, const iBookmark *bm) {
-    iUnused(context);
-    static iRegExp *pattern_ = NULL;
-    if (!pattern_) {
-        pattern_ = new_RegExp("\\bsubscribed\\b", caseSensitive_RegExpOption);
-    }
-    iRegExpMatch m;
-    init_RegExpMatch(&m);
-    return matchString_RegExp(pattern_, &bm->tags, &m);
-}
-
 static const iPtrArray *listSubscriptions_(void) {
-    return list_Bookmarks(bookmarks_App(), NULL, isSubscribed_, NULL);
+    return listTag_Bookmarks(bookmarks_App(), "subscribed", NULL);
 }
 
 static iFeedJob *startNextJob_Feeds_(iFeeds *d) {
@@ -33,12 +33,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <the_Foundation/regexp.h>
 
 #include <ctype.h>
+#include <limits.h>
+#include <string.h>
 
 iDeclareType(GmLink)
 
 struct Impl_GmLink {
     iString url;
     iRangecc urlRange; /* URL in the source */
+    iRangecc labelRange; /* description in the source */
     iTime when;
     int flags;
 };
@@ -46,6 +49,7 @@ struct Impl_GmLink {
 void init_GmLink(iGmLink *d) {
     init_String(&d->url);
     d->urlRange = iNullRange;
+    d->labelRange = iNullRange;
     iZap(d->when);
     d->flags = 0;
 }
@@ -74,8 +78,19 @@ struct Impl_GmDocument {
     uint32_t  themeSeed;
     iChar     siteIcon;
     iMedia *  media;
+    iBool     isLarge;      /* only the lines near the viewport are laid out */
+    iArray    lineOffsets;  /* size_t; start of each source line in a large document */
+    iRangei   laidOutLines; /* lines of a large document currently in `layout` */
+    size_t    normSourcePos;    /* complete lines of a partial source already normalized */
+    uint32_t  normSourceHash;   /* of the source up to `normSourcePos` */
+    size_t    normOutputPos;    /* length of the normalized part of `source` */
+    iBool     isNormPreformat;  /* preformatted state at `normSourcePos` */
 };
 
+/* Plain text documents larger than this are displayed without normalization and laid out
+   on demand, one window of lines at a time. */
+static const size_t largeSourceSize_GmDocument_ = 4 * 1024 * 1024;
+
 iDefineObjectConstruction(GmDocument)
 
 enum iGmLineType {
@@ -212,7 +227,8 @@ static iRangecc addLink_GmDocument_(iGmDocument *d, iRangecc line, iGmLinkId *li
             }
             /* Check if visited. */
             if (cmpString_String(&link->url, &d->url)) {
-                link->when = urlVisitTime_Visited(visited_App(), &link->url);
+                const iRangecc url = range_String(&link->url);
+                link->when = visitTime_Visited(visited_App(), url, urlHash_Visited(url));
                 if (isValid_Time(&link->when)) {
                     link->flags |= visited_GmLinkFlag;
                 }
@@ -224,6 +240,7 @@ static iRangecc addLink_GmDocument_(iGmDocument *d, iRangecc line, iGmLinkId *li
         trim_Rangecc(&desc);
         if (!isEmpty_Range(&desc)) {
             line = desc; /* Just show the description. */
+            link->labelRange = desc;
             link->flags |= humanReadable_GmLinkFlag;
         }
         else {
@@ -233,6 +250,82 @@ static iRangecc addLink_GmDocument_(iGmDocument *d, iRangecc line, iGmLinkId *li
     return line;
 }
 
+static void indexLines_GmDocument_(iGmDocument *d) {
+    const char *start = constBegin_String(&d->source);
+    const char *end   = constEnd_String(&d->source);
+    const char *pos   = start;
+    if (!isEmpty_Array(&d->lineOffsets)) {
+        /* The source has grown; the last indexed line may have continued. */
+        pos = start + *(const size_t *) constBack_Array(&d->lineOffsets);
+        popBack_Array(&d->lineOffsets);
+    }
+    while (pos < end) {
+        const size_t offset = pos - start;
+        pushBack_Array(&d->lineOffsets, &offset);
+        const char *next = memchr(pos, '\n', end - pos);
+        if (!next) break;
+        pos = next + 1;
+    }
+}
+
+static iRangecc largeLine_GmDocument_(const iGmDocument *d, size_t index) {
+    const char *  src     = constBegin_String(&d->source);
+    const size_t *offsets = constData_Array(&d->lineOffsets);
+    iRangecc      line    = { src + offsets[index],
+                              index + 1 < size_Array(&d->lineOffsets) ? src + offsets[index + 1]
+                                                                      : constEnd_String(&d->source) };
+    while (line.end > line.start && (line.end[-1] == '\n' || line.end[-1] == '\r')) {
+        line.end--;
+    }
+    return line;
+}
+
+static size_t largeLineAtLoc_GmDocument_(const iGmDocument *d, const char *loc) {
+    const size_t  pos     = loc - constBegin_String(&d->source);
+    const size_t *offsets = constData_Array(&d->lineOffsets);
+    size_t        lo      = 0;
+    size_t        hi      = size_Array(&d->lineOffsets);
+    while (hi - lo > 1) {
+        const size_t mid = (lo + hi) / 2;
+        if (offsets[mid] <= pos) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static size_t numLargeLines_GmDocument_(const iGmDocument *d) {
+    /* Positions are ints, so lines further down than that can't be shown. */
+    const size_t maxLines = INT_MAX / lineHeight_Text(regularMonospace_FontId) - 1;
+    return iMin(size_Array(&d->lineOffsets), maxLines);
+}
+
+static void layoutLargeLines_GmDocument_(iGmDocument *d, iRangei lines) {
+    const int font       = regularMonospace_FontId;
+    const int lineHeight = lineHeight_Text(font);
+    const int indent     = 5 * gap_Text; /* same as preformatted text */
+    clear_Array(&d->layout);
+    for (int i = lines.start; i < lines.end; i++) {
+        const iRangecc line = largeLine_GmDocument_(d, i);
+        if (isEmpty_Range(&line)) {
+            continue;
+        }
+        const iInt2 dims = advanceRange_Text(font, line);
+        iGmRun run = { .text  = line,
+                       .font  = font,
+                       .color = tmParagraph_ColorId,
+                       .flags = startOfLine_GmRunFlag | endOfLine_GmRunFlag };
+        iChangeFlags(run.flags, wide_GmRunFlag, dims.x > d->size.x);
+        run.bounds    = init_Rect(indent, i * lineHeight, dims.x, lineHeight);
+        run.visBounds = run.bounds;
+        pushBack_Array(&d->layout, &run);
+    }
+    d->laidOutLines = lines;
+}
+
 static void clearLinks_GmDocument_(iGmDocument *d) {
     iForEach(PtrArray, i, &d->links) {
         delete_GmLink(i.ptr);
@@ -297,9 +390,15 @@ static void doLayout_GmDocument_(iGmDocument *d) {
     clear_Array(&d->headings);
     clear_String(&d->title);
     clear_String(&d->bannerText);
+    d->laidOutLines = (iRangei){ 0, 0 };
     if (d->size.x <= 0 || isEmpty_String(&d->source)) {
         return;
     }
+    if (d->isLarge) {
+        /* Lines are laid out later as they become visible. */
+        d->size.y = (int) numLargeLines_GmDocument_(d) * lineHeight_Text(regularMonospace_FontId);
+        return;
+    }
     const iRangecc   content       = range_String(&d->source);
     iRangecc         contentLine   = iNullRange;
     iInt2            pos           = zero_I2();
@@ -387,6 +486,9 @@ static void doLayout_GmDocument_(iGmDocument *d) {
                     banner.visBounds.size.y += iMaxi(6000 * lineHeight_Text(uiLabel_FontId) /
                                                          d->size.x, lineHeight_Text(uiLabel_FontId) * 5);
                 }
+                else if (d->bannerType == savedCopy_GmDocumentBanner) {
+                    banner.visBounds.size.y += lineHeight_Text(uiLabel_FontId) * 3;
+                }
                 banner.font      = banner_FontId;
                 banner.text      = bannerText;
                 banner.color     = tmBannerTitle_ColorId;
@@ -634,10 +736,18 @@ void init_GmDocument(iGmDocument *d) {
     d->themeSeed = 0;
     d->siteIcon = 0;
     d->media = new_Media();
+    d->isLarge = iFalse;
+    init_Array(&d->lineOffsets, sizeof(size_t));
+    d->laidOutLines = (iRangei){ 0, 0 };
+    d->normSourcePos = 0;
+    d->normSourceHash = 0;
+    d->normOutputPos = 0;
+    d->isNormPreformat = iFalse;
 }
 
 void deinit_GmDocument(iGmDocument *d) {
     delete_Media(d->media);
+    deinit_Array(&d->lineOffsets);
     deinit_String(&d->bannerText);
     deinit_String(&d->title);
     clearLinks_GmDocument_(d);
@@ -662,9 +772,13 @@ void reset_GmDocument(iGmDocument *d) {
     clearLinks_GmDocument_(d);
     clear_Array(&d->layout);
     clear_Array(&d->headings);
+    clear_Array(&d->lineOffsets);
     clear_String(&d->url);
     clear_String(&d->localHost);
     d->themeSeed = 0;
+    d->isLarge = iFalse;
+    d->normSourcePos = 0;
+    d->normOutputPos = 0;
 }
 
 static void setDerivedThemeColors_(enum iGmDocumentTheme theme) {
@@ -1105,69 +1219,112 @@ iLocalDef iBool isNormalizableSpace_(char ch) {
     return ch == ' ' || ch == '\t';
 }
 
-static void normalize_GmDocument(iGmDocument *d) {
-    iString *normalized = new_String();
-    iRangecc src = range_String(&d->source);
-    iRangecc line = iNullRange;
-    iBool isPreformat = iFalse;
-    if (d->format == plainText_GmDocumentFormat) { // || isGopher_GmDocument_(d)) {
-        isPreformat = iTrue; /* Cannot be turned off. */
-    }
+static void normalizeLine_GmDocument_(const iGmDocument *d, iRangecc line, iBool *isPreformat,
+                                      iString *normalized) {
     const int preTabWidth = 4; /* TODO: user-configurable parameter */
-    while (nextSplit_Rangecc(src, "\n", &line)) {
-        if (isPreformat) {
-            /* Replace any tab characters with spaces for visualization. */
-            for (const char *ch = line.start; ch != line.end; ch++) {
-                if (*ch == '\t') {
-                    int column = ch - line.start;
-                    int numSpaces = (column / preTabWidth + 1) * preTabWidth - column;
-                    while (numSpaces-- > 0) {
-                        appendCStrN_String(normalized, " ", 1);
-                    }
-                }
-                else if (*ch != '\r') {
-                    appendCStrN_String(normalized, ch, 1);
+    if (*isPreformat) {
+        /* Replace any tab characters with spaces for visualization. */
+        for (const char *ch = line.start; ch != line.end; ch++) {
+            if (*ch == '\t') {
+                int column = ch - line.start;
+                int numSpaces = (column / preTabWidth + 1) * preTabWidth - column;
+                while (numSpaces-- > 0) {
+                    appendCStrN_String(normalized, " ", 1);
                 }
             }
-            appendCStr_String(normalized, "\n");
-            if (lineType_GmDocument_(d, line) == preformatted_GmLineType) {
-                isPreformat = iFalse;
+            else if (*ch != '\r') {
+                appendCStrN_String(normalized, ch, 1);
             }
-            continue;
         }
+        appendCStr_String(normalized, "\n");
         if (lineType_GmDocument_(d, line) == preformatted_GmLineType) {
-            isPreformat = iTrue;
-            appendRange_String(normalized, line);
-            appendCStr_String(normalized, "\n");
-            continue;
+            *isPreformat = iFalse;
         }
-        iBool isPrevSpace = iFalse;
-        int spaceCount = 0;
-        for (const char *ch = line.start; ch != line.end; ch++) {
-            char c = *ch;
-            if (c == '\r') continue;
-            if (isNormalizableSpace_(c)) {
-                if (isPrevSpace) {
-                    if (++spaceCount == 8) {
-                        /* There are several consecutive space characters. The author likely
-                           really wants to have some space here, so normalize to a tab stop. */
-                        popBack_Block(&normalized->chars);
-                        pushBack_Block(&normalized->chars, '\t');
-                    }
-                    continue; /* skip repeated spaces */
+        return;
+    }
+    if (lineType_GmDocument_(d, line) == preformatted_GmLineType) {
+        *isPreformat = iTrue;
+        appendRange_String(normalized, line);
+        appendCStr_String(normalized, "\n");
+        return;
+    }
+    iBool isPrevSpace = iFalse;
+    int spaceCount = 0;
+    for (const char *ch = line.start; ch != line.end; ch++) {
+        char c = *ch;
+        if (c == '\r') continue;
+        if (isNormalizableSpace_(c)) {
+            if (isPrevSpace) {
+                if (++spaceCount == 8) {
+                    /* There are several consecutive space characters. The author likely
+                       really wants to have some space here, so normalize to a tab stop. */
+                    popBack_Block(&normalized->chars);
+                    pushBack_Block(&normalized->chars, '\t');
                 }
-                c = ' ';
-                isPrevSpace = iTrue;
+                continue; /* skip repeated spaces */
             }
-            else {
-                isPrevSpace = iFalse;
-                spaceCount = 0;
-            }
-            appendCStrN_String(normalized, &c, 1);
+            c = ' ';
+            isPrevSpace = iTrue;
         }
-        appendCStr_String(normalized, "\n");
+        else {
+            isPrevSpace = iFalse;
+            spaceCount = 0;
+        }
+        appendCStrN_String(normalized, &c, 1);
+    }
+    appendCStr_String(normalized, "\n");
+}
+
+static const uint32_t initialSourceHash_GmDocument_ = 0x811c9dc5;
+
+static uint32_t sourceHash_GmDocument_(uint32_t hash, iRangecc range) {
+    /* FNV-1a; continues from `hash` */
+    for (const char *ch = range.start; ch != range.end; ch++) {
+        hash ^= (uint8_t) *ch;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static void normalize_GmDocument(iGmDocument *d, const iString *source,
+                                 enum iGmDocumentUpdate updateType) {
+    const iRangecc src = range_String(source);
+    /* The already normalized lines can only be kept if the source still begins with them.
+       It may have been replaced entirely, e.g., when decoding falls back to another
+       character set. */
+    if (updateType == final_GmDocumentUpdate || d->normSourcePos > size_Range(&src) ||
+        (d->normSourcePos &&
+         sourceHash_GmDocument_(initialSourceHash_GmDocument_,
+                                (iRangecc){ src.start, src.start + d->normSourcePos }) !=
+             d->normSourceHash)) {
+        /* Start over from the beginning. */
+        d->normSourcePos = 0;
+        d->normOutputPos = 0;
+    }
+    if (d->normSourcePos == 0) {
+        d->normSourceHash  = initialSourceHash_GmDocument_;
+        d->isNormPreformat = (d->format == plainText_GmDocumentFormat); /* cannot be turned off */
+    }
+    const size_t prevSourcePos = d->normSourcePos;
+    /* Complete lines of a partial source are normalized only once. The last, possibly
+       incomplete line is redone when more of it arrives. */
+    truncate_Block(&d->source.chars, d->normOutputPos);
+    iBool       isPreformat = d->isNormPreformat;
+    const char *pos         = src.start + d->normSourcePos;
+    while (pos < src.end) {
+        const char *end = memchr(pos, '\n', src.end - pos);
+        normalizeLine_GmDocument_(d, (iRangecc){ pos, end ? end : src.end }, &isPreformat,
+                                  &d->source);
+        if (!end) {
+            break;
+        }
+        pos = end + 1;
+        d->normSourcePos   = pos - src.start;
+        d->normOutputPos   = size_String(&d->source);
+        d->isNormPreformat = isPreformat;
     }
-    set_String(&d->source, collect_String(normalized));
+    d->normSourceHash = sourceHash_GmDocument_(
+        d->normSourceHash, (iRangecc){ src.start + prevSourcePos, src.start + d->normSourcePos });
 }
 
 void setUrl_GmDocument(iGmDocument *d, const iString *url) {
@@ -1177,12 +1334,61 @@ void setUrl_GmDocument(iGmDocument *d, const iString *url) {
     setRange_String(&d->localHost, parts.host);
 }
 
-void setSource_GmDocument(iGmDocument *d, const iString *source, int width) {
-    set_String(&d->source, source);
-    normalize_GmDocument(d);
+void setSource_GmDocument(iGmDocument *d, const iString *source, int width,
+                          enum iGmDocumentUpdate updateType) {
+    const iBool wasLarge = d->isLarge;
+    d->isLarge = (d->format == plainText_GmDocumentFormat &&
+                  size_String(source) >= largeSourceSize_GmDocument_);
+    if (d->isLarge) {
+        /* The source is used as is; normalizing would mean yet another full copy. */
+        if (updateType == final_GmDocumentUpdate) {
+            set_String(&d->source, source); /* shared; will not change any more */
+            clear_Array(&d->lineOffsets);
+        }
+        else if (wasLarge && size_String(&d->source) <= size_String(source)) {
+            /* Sharing a response body that is still growing would cause it to be copied
+               on every update, so just append the new part. */
+            appendData_Block(&d->source.chars,
+                             constBegin_String(source) + size_String(&d->source),
+                             size_String(source) - size_String(&d->source));
+        }
+        else {
+            setRange_String(&d->source, range_String(source));
+            clear_Array(&d->lineOffsets);
+        }
+        indexLines_GmDocument_(d);
+        d->normSourcePos = 0;
+        d->normOutputPos = 0;
+    }
+    else {
+        clear_Array(&d->lineOffsets);
+        normalize_GmDocument(d, source, updateType);
+    }
     setWidth_GmDocument(d, width); /* re-do layout */
 }
 
+iBool updateLayoutRange_GmDocument(iGmDocument *d, iRangei visRangeY) {
+    if (!d->isLarge || d->size.x <= 0) {
+        return iFalse;
+    }
+    const int lineHeight = lineHeight_Text(regularMonospace_FontId);
+    const int numLines   = (int) numLargeLines_GmDocument_(d);
+    const int numVisible = size_Range(&visRangeY) / lineHeight + 1;
+    /* The visible lines plus one screenful above and below. */
+    iRangei needed = { iMax(0, visRangeY.start / lineHeight - numVisible),
+                       iMin(numLines, visRangeY.end / lineHeight + 1 + numVisible) };
+    needed.start = iMin(needed.start, needed.end);
+    if (d->laidOutLines.end > d->laidOutLines.start &&
+        needed.start >= d->laidOutLines.start && needed.end <= d->laidOutLines.end) {
+        return iFalse;
+    }
+    /* Extra slack so that scrolling doesn't cause a relayout on every step. */
+    layoutLargeLines_GmDocument_(d,
+                                 (iRangei){ iMax(0, needed.start - numVisible),
+                                            iMin(numLines, needed.end + numVisible) });
+    return iTrue;
+}
+
 void render_GmDocument(const iGmDocument *d, iRangei visRangeY, iGmDocumentRenderFunc render,
                        void *context) {
     iBool isInside = iFalse;
@@ -1237,6 +1443,27 @@ const iString *source_GmDocument(const iGmDocument *d) {
     return &d->source;
 }
 
+iBool isLarge_GmDocument(const iGmDocument *d) {
+    return d->isLarge;
+}
+
+size_t memorySize_GmDocument(const iGmDocument *d) {
+    return size_String(&d->source) + size_Array(&d->layout) * sizeof(iGmRun) +
+           size_PtrArray(&d->links) * sizeof(iGmLink) +
+           size_Array(&d->lineOffsets) * sizeof(size_t) + memorySize_Media(d->media);
+}
+
+iRangei locLineSpan_GmDocument(const iGmDocument *d, const char *loc) {
+    if (!d->isLarge || isEmpty_Array(&d->lineOffsets) || !loc ||
+        loc < constBegin_String(&d->source) || loc > constEnd_String(&d->source)) {
+        return (iRangei){ 0, 0 };
+    }
+    const int lineHeight = lineHeight_Text(regularMonospace_FontId);
+    const int top        = (int) iMin(largeLineAtLoc_GmDocument_(d, loc),
+                                      numLargeLines_GmDocument_(d) - 1) * lineHeight;
+    return (iRangei){ top, top + lineHeight };
+}
+
 iRangecc findText_GmDocument(const iGmDocument *d, const iString *text, const char *start) {
     const char * src      = constBegin_String(&d->source);
     const size_t startPos = (start ? start - src : 0);
@@ -1314,6 +1541,14 @@ const char *findLoc_GmDocument(const iGmDocument *d, iInt2 pos) {
 }
 
 const iGmRun *findRunAtLoc_GmDocument(const iGmDocument *d, const char *textCStr) {
+    if (d->isLarge && !isEmpty_Array(&d->layout)) {
+        /* Only part of a large document is laid out. */
+        const iGmRun *first = constFront_Array(&d->layout);
+        const iGmRun *last  = constBack_Array(&d->layout);
+        if (textCStr < first->text.start || textCStr > last->text.end) {
+            return NULL;
+        }
+    }
     iConstForEach(Array, i, &d->layout) {
         const iGmRun *run = i.value;
         if (run->flags & decoration_GmRunFlag) {
@@ -1353,6 +1588,15 @@ const iTime *linkTime_GmDocument(const iGmDocument *d, iGmLinkId linkId) {
     return link ? &link->when : NULL;
 }
 
+iRangecc linkLabel_GmDocument(const iGmDocument *d, iGmLinkId linkId) {
+    const iGmLink *link = link_GmDocument_(d, linkId);
+    return link ? link->labelRange : iNullRange;
+}
+
+size_t numLinks_GmDocument(const iGmDocument *d) {
+    return size_PtrArray(&d->links);
+}
+
 iMediaId linkImage_GmDocument(const iGmDocument *d, iGmLinkId linkId) {
     return findLinkImage_Media(d->media, linkId);
 }
@@ -115,10 +115,16 @@ enum iGmDocumentFormat {
     plainText_GmDocumentFormat,
 };
 
+enum iGmDocumentUpdate {
+    partial_GmDocumentUpdate, /* appended more content to previous partial source */
+    final_GmDocumentUpdate,
+};
+
 enum iGmDocumentBanner {
     none_GmDocumentBanner,
     siteDomain_GmDocumentBanner,
     certificateWarning_GmDocumentBanner,
+    savedCopy_GmDocumentBanner, /* couldn't connect; showing a cached copy */
 };
 
 void    setThemeSeed_GmDocument (iGmDocument *, const iBlock *seed);
@@ -127,7 +133,9 @@ void    setBanner_GmDocument    (iGmDocument *, enum iGmDocumentBanner type);
 void    setWidth_GmDocument     (iGmDocument *, int width);
 void    redoLayout_GmDocument   (iGmDocument *);
 void    setUrl_GmDocument       (iGmDocument *, const iString *url);
-void    setSource_GmDocument    (iGmDocument *, const iString *source, int width);
+void    setSource_GmDocument    (iGmDocument *, const iString *source, int width,
+                                 enum iGmDocumentUpdate updateType);
+iBool   updateLayoutRange_GmDocument(iGmDocument *, iRangei visRangeY); /* large documents */
 
 void    reset_GmDocument        (iGmDocument *); /* free images */
 
@@ -145,6 +153,9 @@ enum iGmDocumentBanner bannerType_GmDocument(const iGmDocument *);
 const iString * bannerText_GmDocument       (const iGmDocument *);
 const iArray *  headings_GmDocument         (const iGmDocument *); /* array of GmHeadings */
 const iString * source_GmDocument           (const iGmDocument *);
+iBool           isLarge_GmDocument          (const iGmDocument *);
+size_t          memorySize_GmDocument       (const iGmDocument *); /* approximate, with media */
+iRangei         locLineSpan_GmDocument      (const iGmDocument *, const char *loc);
 
 iRangecc        findText_GmDocument                 (const iGmDocument *, const iString *text, const char *start);
 iRangecc        findTextBefore_GmDocument           (const iGmDocument *, const iString *text, const char *before);
@@ -163,6 +174,8 @@ const char *    findLoc_GmDocument      (const iGmDocument *, iInt2 pos);
 const iGmRun *  findRunAtLoc_GmDocument (const iGmDocument *, const char *loc);
 const iString * linkUrl_GmDocument      (const iGmDocument *, iGmLinkId linkId);
 iRangecc        linkUrlRange_GmDocument (const iGmDocument *, iGmLinkId linkId);
+iRangecc        linkLabel_GmDocument    (const iGmDocument *, iGmLinkId linkId);
+size_t          numLinks_GmDocument     (const iGmDocument *); /* link IDs are 1...N */
 iMediaId        linkImage_GmDocument    (const iGmDocument *, iGmLinkId linkId);
 iMediaId        linkAudio_GmDocument    (const iGmDocument *, iGmLinkId linkId);
 int             linkFlags_GmDocument    (const iGmDocument *, iGmLinkId linkId);
@@ -26,6 +26,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "gopher.h"
 #include "app.h" /* dataDir_App() */
 #include "mimehooks.h"
+#include "resolver.h"
 #include "feeds.h"
 #include "ui/text.h"
 #include "embedded.h"
@@ -34,11 +35,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <the_Foundation/file.h>
 #include <the_Foundation/mutex.h>
 #include <the_Foundation/path.h>
+#include <the_Foundation/ptrarray.h>
 #include <the_Foundation/regexp.h>
 #include <the_Foundation/socket.h>
 #include <the_Foundation/tlsrequest.h>
 
 #include <SDL_timer.h>
+#include <ctype.h>
 
 iDefineTypeConstruction(GmResponse)
 
@@ -83,6 +86,7 @@ void clear_GmResponse(iGmResponse *d) {
 }
 
 iGmResponse *copy_GmResponse(const iGmResponse *d) {
+    /* The body is implicitly shared, not copied. */
     iGmResponse *copied = iMalloc(GmResponse);
     initCopy_GmResponse(copied, d);
     return copied;
@@ -123,6 +127,12 @@ enum iGmRequestState {
     failure_GmRequestState,
 };
 
+enum iGmRequestScheduleState {
+    none_GmRequestScheduleState,
+    queued_GmRequestScheduleState,
+    running_GmRequestScheduleState,
+};
+
 struct Impl_GmRequest {
     iObject              object;
     iMutex *             mtx;
@@ -132,9 +142,17 @@ struct Impl_GmRequest {
     iTlsRequest *        req;
     iGopher              gopher;
     iGmResponse *        resp;
+    char                 header[2 + 1 + 1024 + 1]; /* status, space, <META>, CR */
+    size_t               headerSize;
     iBool                isRespLocked;
     iBool                isRespFiltered;
     iAtomicInt           allowUpdate;
+    uint32_t             submitTime;    /* SDL ticks */
+    uint32_t             firstByteTime; /* SDL ticks; zero if nothing received yet */
+    enum iGmRequestPriority priority;
+    enum iGmRequestScheduleState scheduleState;
+    iBool                isStarting; /* being started outside `scheduleMutex_` */
+    iString              connectionHost; /* for per-host limits */
     iAudience *          updated;
     iAudience *          finished;
 };
@@ -143,6 +161,347 @@ iDefineObjectConstructionArgs(GmRequest, (iGmCerts *certs), certs)
 iDefineAudienceGetter(GmRequest, updated)
 iDefineAudienceGetter(GmRequest, finished)
 
+/*----------------------------------------------------------------------------------------------*/
+
+iDeclareType(GmHostStats)
+
+struct Impl_GmHostStats {
+    iString  host;
+    uint32_t lastUsed; /* SDL ticks */
+    unsigned numRequests;
+    int      lastTimeToFirstByte; /* ms */
+    uint64_t totalTimeToFirstByte;
+};
+
+static iMutex *hostStatsMutex_;
+static iArray  hostStats_;
+static const size_t maxHostStats_GmRequest_ = 32; /* least recently used are forgotten */
+
+static void recordTimeToFirstByte_GmRequest_(const iString *host, int ms) {
+    if (!hostStatsMutex_) {
+        return;
+    }
+    lock_Mutex(hostStatsMutex_);
+    iGmHostStats *stats  = NULL;
+    iGmHostStats *oldest = NULL;
+    iForEach(Array, i, &hostStats_) {
+        iGmHostStats *hs = i.value;
+        if (equalCase_String(&hs->host, host)) {
+            stats = hs;
+            break;
+        }
+        if (!oldest || hs->lastUsed < oldest->lastUsed) {
+            oldest = hs;
+        }
+    }
+    if (!stats) {
+        if (size_Array(&hostStats_) < maxHostStats_GmRequest_) {
+            iGmHostStats newStats;
+            iZap(newStats);
+            init_String(&newStats.host);
+            pushBack_Array(&hostStats_, &newStats);
+            stats = back_Array(&hostStats_);
+        }
+        else {
+            stats = oldest;
+            deinit_String(&stats->host);
+            iZap(*stats);
+            init_String(&stats->host);
+        }
+        set_String(&stats->host, host);
+    }
+    stats->lastUsed = SDL_GetTicks();
+    stats->numRequests++;
+    stats->lastTimeToFirstByte = ms;
+    stats->totalTimeToFirstByte += ms;
+    unlock_Mutex(hostStatsMutex_);
+}
+
+const iString *debugInfo_GmRequest(void) {
+    iString *str = collectNew_String();
+    if (!hostStatsMutex_) {
+        return str;
+    }
+    lock_Mutex(hostStatsMutex_);
+    iConstForEach(Array, i, &hostStats_) {
+        const iGmHostStats *hs = i.value;
+        appendFormat_String(str,
+                            "* %s: %u request%s, time to first byte %d ms (average %d ms)\n",
+                            cstr_String(&hs->host),
+                            hs->numRequests,
+                            hs->numRequests != 1 ? "s" : "",
+                            hs->lastTimeToFirstByte,
+                            (int) (hs->totalTimeToFirstByte / iMax(1u, hs->numRequests)));
+    }
+    unlock_Mutex(hostStatsMutex_);
+    return str;
+}
+
+/*----------------------------------------------------------------------------------------------*/
+
+iDeclareType(GmHostLoad)
+
+struct Impl_GmHostLoad {
+    iString  host;
+    int      numRunning;
+    uint32_t lastStarted; /* SDL ticks */
+};
+
+static const int      maxRunning_GmRequest_         = 6; /* foreground requests may exceed this */
+static const int      maxRunningPerHost_GmRequest_  = 2;
+static const uint32_t hostIntervalMs_GmRequest_     = 200; /* between starts of queued requests */
+static const int      maxRunningForPriority_GmRequest_[max_GmRequestPriority] = { 2, 4, 6, 6 };
+
+static iMutex *    scheduleMutex_;
+static iCondition  startedCond_; /* signaled when queued requests have been started */
+static iPtrArray   queued_;      /* GmRequests (not referenced), oldest first */
+static iArray      hostLoads_;
+static int         numRunning_[max_GmRequestPriority];
+static int         scheduleTimer_;
+static iBool       isStartPosted_;
+
+static void start_GmRequest_(iGmRequest *d);
+
+void initConnections_GmRequest(void) {
+    hostStatsMutex_ = new_Mutex();
+    init_Array(&hostStats_, sizeof(iGmHostStats));
+    scheduleMutex_ = new_Mutex();
+    init_Condition(&startedCond_);
+    init_PtrArray(&queued_);
+    init_Array(&hostLoads_, sizeof(iGmHostLoad));
+    iZap(numRunning_);
+    scheduleTimer_ = 0;
+    isStartPosted_ = iFalse;
+}
+
+void deinitConnections_GmRequest(void) {
+    if (scheduleTimer_) {
+        SDL_RemoveTimer(scheduleTimer_);
+        scheduleTimer_ = 0;
+    }
+    iGuardMutex(scheduleMutex_, {
+        iForEach(PtrArray, q, &queued_) {
+            ((iGmRequest *) q.ptr)->scheduleState = none_GmRequestScheduleState;
+        }
+        clear_PtrArray(&queued_);
+    });
+    deinit_PtrArray(&queued_);
+    iForEach(Array, h, &hostLoads_) {
+        deinit_String(&((iGmHostLoad *) h.value)->host);
+    }
+    deinit_Array(&hostLoads_);
+    delete_Mutex(scheduleMutex_);
+    scheduleMutex_ = NULL;
+    deinit_Condition(&startedCond_);
+    iForEach(Array, i, &hostStats_) {
+        deinit_String(&((iGmHostStats *) i.value)->host);
+    }
+    deinit_Array(&hostStats_);
+    delete_Mutex(hostStatsMutex_);
+    hostStatsMutex_ = NULL;
+}
+
+static iGmHostLoad *hostLoad_GmRequest_(const iString *host) {
+    iForEach(Array, i, &hostLoads_) {
+        iGmHostLoad *load = i.value;
+        if (equalCase_String(&load->host, host)) {
+            return load;
+        }
+    }
+    return NULL;
+}
+
+static void postStartQueued_GmRequest_(void) {
+    /* Queued requests are only started in the main thread. One pending command is enough. */
+    if (!scheduleMutex_) {
+        return;
+    }
+    iBool doPost = iFalse;
+    iGuardMutex(scheduleMutex_, {
+        doPost = !isStartPosted_;
+        isStartPosted_ = iTrue;
+    });
+    if (doPost) {
+        postCommand_App("requests.schedule");
+    }
+}
+
+static uint32_t postScheduleUpdate_GmRequest_(uint32_t interval, void *data) {
+    iUnused(interval, data);
+    iGuardMutex(scheduleMutex_, scheduleTimer_ = 0);
+    postStartQueued_GmRequest_();
+    return 0;
+}
+
+static iBool canStart_GmRequest_(const iGmRequest *d, uint32_t now, uint32_t *wait_out) {
+    /* Called with `scheduleMutex_` locked. */
+    if (d->priority == foreground_GmRequestPriority) {
+        return iTrue; /* the user is waiting for this */
+    }
+    int total = 0;
+    iForIndices(i, numRunning_) {
+        total += numRunning_[i];
+    }
+    if (total >= maxRunning_GmRequest_ ||
+        numRunning_[d->priority] >= maxRunningForPriority_GmRequest_[d->priority]) {
+        return iFalse;
+    }
+    const iGmHostLoad *load = hostLoad_GmRequest_(&d->connectionHost);
+    if (load) {
+        if (load->numRunning >= maxRunningPerHost_GmRequest_) {
+            return iFalse;
+        }
+        const uint32_t elapsed = now - load->lastStarted;
+        if (elapsed < hostIntervalMs_GmRequest_) {
+            const uint32_t wait = hostIntervalMs_GmRequest_ - elapsed;
+            *wait_out = *wait_out ? iMin(*wait_out, wait) : wait;
+            return iFalse;
+        }
+    }
+    return iTrue;
+}
+
+static void markRunning_GmRequest_(iGmRequest *d, uint32_t now) {
+    /* Called with `scheduleMutex_` locked. */
+    iGmHostLoad *load = hostLoad_GmRequest_(&d->connectionHost);
+    if (!load) {
+        iGmHostLoad newLoad = { .numRunning = 0 };
+        initCopy_String(&newLoad.host, &d->connectionHost);
+        pushBack_Array(&hostLoads_, &newLoad);
+        load = back_Array(&hostLoads_);
+    }
+    load->numRunning++;
+    load->lastStarted = now;
+    numRunning_[d->priority]++;
+    d->scheduleState = running_GmRequestScheduleState;
+    d->isStarting = iTrue;
+}
+
+static void waitUntilStarted_GmRequest_(const iGmRequest *d) {
+    /* Called with `scheduleMutex_` locked. Request finish notifications must not release or
+       cancel the request directly, or this would wait for itself. */
+    while (d->isStarting) {
+        wait_Condition(&startedCond_, scheduleMutex_);
+    }
+}
+
+void startQueued_GmRequest(void) {
+    if (!scheduleMutex_) {
+        return;
+    }
+    iPtrArray starting;
+    init_PtrArray(&starting);
+    lock_Mutex(scheduleMutex_);
+    isStartPosted_ = iFalse;
+    const uint32_t now  = SDL_GetTicks();
+    uint32_t       wait = 0;
+    /* Forget hosts that no longer limit anything. */
+    for (size_t i = 0; i < size_Array(&hostLoads_); ) {
+        iGmHostLoad *load = at_Array(&hostLoads_, i);
+        if (load->numRunning == 0 && now - load->lastStarted >= hostIntervalMs_GmRequest_) {
+            deinit_String(&load->host);
+            remove_Array(&hostLoads_, i);
+        }
+        else {
+            i++;
+        }
+    }
+    for (int prio = max_GmRequestPriority - 1; prio >= 0; prio--) {
+        for (size_t i = 0; i < size_PtrArray(&queued_); ) {
+            iGmRequest *req = at_PtrArray(&queued_, i);
+            if (req->priority == prio && canStart_GmRequest_(req, now, &wait)) {
+                markRunning_GmRequest_(req, now);
+                pushBack_PtrArray(&starting, req);
+                remove_Array(&queued_, i);
+            }
+            else {
+                i++;
+            }
+        }
+    }
+    if (wait && !scheduleTimer_) {
+        scheduleTimer_ = SDL_AddTimer(wait, postScheduleUpdate_GmRequest_, NULL);
+    }
+    unlock_Mutex(scheduleMutex_);
+    /* The queue does not own the requests. While a request is being started,
+       deinit_GmRequest() and cancel_GmRequest() wait for it, so it cannot be freed or
+       left running after a cancel. */
+    iForEach(PtrArray, i, &starting) {
+        start_GmRequest_(i.ptr);
+    }
+    iGuardMutex(scheduleMutex_, {
+        iForEach(PtrArray, j, &starting) {
+            iGmRequest *req = j.ptr;
+            req->isStarting = iFalse;
+        }
+        signalAll_Condition(&startedCond_);
+    });
+    deinit_PtrArray(&starting);
+}
+
+static void schedule_GmRequest_(iGmRequest *d) {
+    if (d->priority == foreground_GmRequestPriority) {
+        /* The user is waiting for this, so it is started right away by the owner. */
+        iGuardMutex(scheduleMutex_, markRunning_GmRequest_(d, SDL_GetTicks()));
+        start_GmRequest_(d);
+        iGuardMutex(scheduleMutex_, {
+            d->isStarting = iFalse;
+            signalAll_Condition(&startedCond_);
+        });
+        return;
+    }
+    iGuardMutex(scheduleMutex_, {
+        d->scheduleState = queued_GmRequestScheduleState;
+        pushBack_PtrArray(&queued_, d);
+    });
+    postStartQueued_GmRequest_();
+}
+
+static iBool dequeue_GmRequest_(iGmRequest *d) {
+    /* Returns True if the request was still waiting in the queue. It will not be started. */
+    iBool wasQueued = iFalse;
+    if (!scheduleMutex_) {
+        return iFalse;
+    }
+    lock_Mutex(scheduleMutex_);
+    if (d->scheduleState == queued_GmRequestScheduleState) {
+        removeOne_PtrArray(&queued_, d);
+        d->scheduleState = none_GmRequestScheduleState;
+        wasQueued = iTrue;
+    }
+    else {
+        waitUntilStarted_GmRequest_(d); /* then it can be cancelled */
+    }
+    unlock_Mutex(scheduleMutex_);
+    return wasQueued;
+}
+
+static void unschedule_GmRequest_(iGmRequest *d) {
+    if (!scheduleMutex_) {
+        return;
+    }
+    lock_Mutex(scheduleMutex_);
+    if (d->scheduleState == queued_GmRequestScheduleState) {
+        removeOne_PtrArray(&queued_, d);
+    }
+    else if (d->scheduleState == running_GmRequestScheduleState) {
+        iGmHostLoad *load = hostLoad_GmRequest_(&d->connectionHost);
+        if (load) {
+            load->numRunning--;
+        }
+        numRunning_[d->priority]--;
+    }
+    d->scheduleState = none_GmRequestScheduleState;
+    unlock_Mutex(scheduleMutex_);
+}
+
+static void connectionFinished_GmRequest_(iGmRequest *d) {
+    unschedule_GmRequest_(d);
+    postStartQueued_GmRequest_(); /* a slot may have been freed */
+}
+
+/*----------------------------------------------------------------------------------------------*/
+
 static void checkServerCertificate_GmRequest_(iGmRequest *d) {
     const iTlsCertificate *cert = serverCertificate_TlsRequest(d->req);
     iGmResponse *resp = d->resp;
@@ -166,53 +525,72 @@ static void checkServerCertificate_GmRequest_(iGmRequest *d) {
     }
 }
 
+static const size_t maxMetaSize_GmRequest_ = 1024; /* bytes, per the specification */
+
+/* Parses the header incrementally, looking at each received byte only once. Returns the number
+   of bytes of `data` belonging to the header once it is complete, zero if more data is needed,
+   or iInvalidPos if the header is malformed. */
+static size_t parseHeader_GmRequest_(iGmRequest *d, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        const char ch = data[i];
+        if (ch != '\n') {
+            if (d->headerSize == sizeof(d->header)) {
+                return iInvalidPos; /* <META> is too long */
+            }
+            d->header[d->headerSize++] = ch;
+            continue;
+        }
+        /* The header line is complete: <STATUS><SPACE><META><CR><LF> */
+        iRangecc line = { d->header, d->header + d->headerSize };
+        if (line.end > line.start && line.end[-1] == '\r') {
+            line.end--;
+        }
+        if (size_Range(&line) < 2 || !isdigit((unsigned char) line.start[0]) ||
+            !isdigit((unsigned char) line.start[1])) {
+            return iInvalidPos;
+        }
+        d->resp->statusCode = (line.start[0] - '0') * 10 + (line.start[1] - '0');
+        /* TODO: Empty <META> means no <SPACE>? Not according to the spec? */
+        iRangecc meta = { line.start + 2, line.end };
+        trimStart_Rangecc(&meta);
+        if (size_Range(&meta) > maxMetaSize_GmRequest_) {
+            return iInvalidPos;
+        }
+        setRange_String(&d->resp->meta, meta);
+        return i + 1;
+    }
+    return 0;
+}
+
 static int processIncomingData_GmRequest_(iGmRequest *d, const iBlock *data) {
     iBool        notifyUpdate = iFalse;
     iBool        notifyDone   = iFalse;
     iGmResponse *resp         = d->resp;
     if (d->state == receivingHeader_GmRequestState) {
-        appendCStrN_String(&resp->meta, constData_Block(data), size_Block(data));
-        /* Check if the header line is complete. */
-        size_t endPos = indexOfCStr_String(&resp->meta, "\r\n");
-        if (endPos != iInvalidPos) {
+        const size_t headerUsed =
+            parseHeader_GmRequest_(d, constData_Block(data), size_Block(data));
+        if (headerUsed == iInvalidPos || (headerUsed && resp->statusCode == 0)) {
+            clear_String(&resp->meta);
+            clear_Block(&resp->body);
+            resp->statusCode = invalidHeader_GmStatusCode;
+            d->state         = finished_GmRequestState;
+            notifyDone       = iTrue;
+            checkServerCertificate_GmRequest_(d);
+        }
+        else if (headerUsed) {
             /* Move remainder to the body. */
             setData_Block(&resp->body,
-                          constBegin_String(&resp->meta) + endPos + 2,
-                          size_String(&resp->meta) - endPos - 2);
-            remove_Block(&resp->meta.chars, endPos, iInvalidSize);
-            /* Parse and remove the code. */
-            iRegExp *metaPattern = new_RegExp("^([0-9][0-9])(( )(.*))?", 0);
-            /* TODO: Empty <META> means no <SPACE>? Not according to the spec? */
-            iRegExpMatch m;
-            init_RegExpMatch(&m);
-            int code = 0;
-            if (matchString_RegExp(metaPattern, &resp->meta, &m)) {
-                code = atoi(capturedRange_RegExpMatch(&m, 1).start);
-                remove_Block(&resp->meta.chars,
-                             0,
-                             capturedRange_RegExpMatch(&m, 1).end -
-                                 constBegin_String(&resp->meta)); /* leave just the <META> */
-                trimStart_String(&resp->meta);
+                          constBegin_Block(data) + headerUsed,
+                          size_Block(data) - headerUsed);
+            if (resp->statusCode == success_GmStatusCode && isEmpty_String(&resp->meta)) {
+                setCStr_String(&resp->meta, "text/gemini; charset=utf-8"); /* default */
             }
-            if (code == 0) {
-                clear_String(&resp->meta);
-                resp->statusCode = invalidHeader_GmStatusCode;
-                d->state         = finished_GmRequestState;
-                notifyDone       = iTrue;
-            }
-            else {
-                if (code == success_GmStatusCode && isEmpty_String(&resp->meta)) {
-                    setCStr_String(&resp->meta, "text/gemini; charset=utf-8"); /* default */
-                }
-                resp->statusCode = code;
-                d->state         = receivingBody_GmRequestState;
-                notifyUpdate     = iTrue;
-                if (willTryFilter_MimeHooks(mimeHooks_App(), &resp->meta)) {
-                    d->isRespFiltered = iTrue;
-                }
+            d->state     = receivingBody_GmRequestState;
+            notifyUpdate = iTrue;
+            if (willTryFilter_MimeHooks(mimeHooks_App(), &resp->meta)) {
+                d->isRespFiltered = iTrue;
             }
             checkServerCertificate_GmRequest_(d);
-            iRelease(metaPattern);
         }
     }
     else if (d->state == receivingBody_GmRequestState) {
@@ -227,6 +605,11 @@ static void readIncoming_GmRequest_(iGmRequest *d, iTlsRequest *req) {
     iGmResponse *resp = d->resp;
     iAssert(d->state != finished_GmRequestState); /* notifications out of order? */
     iBlock *  data         = readAll_TlsRequest(req);
+    if (!d->firstByteTime && !isEmpty_Block(data)) {
+        d->firstByteTime = iMax(1u, SDL_GetTicks());
+        recordTimeToFirstByte_GmRequest_(hostName_Address(address_TlsRequest(req)),
+                                         d->firstByteTime - d->submitTime);
+    }
     const int ubits        = processIncomingData_GmRequest_(d, data);
     iBool     notifyUpdate = (ubits & 1) != 0;
     iBool     notifyDone   = (ubits & 2) != 0;
@@ -269,12 +652,14 @@ static void requestFinished_GmRequest_(iGmRequest *d, iTlsRequest *req) {
             lock_Mutex(d->mtx);
             clear_String(&d->resp->meta);
             clear_Block(&d->resp->body);
+            d->headerSize = 0;
             d->state = receivingHeader_GmRequestState;
             processIncomingData_GmRequest_(d, xbody);
             d->state = finished_GmRequestState;
             unlock_Mutex(d->mtx);
         }
     }
+    connectionFinished_GmRequest_(d);
     iNotifyAudience(d, finished, GmRequestFinished);
 }
 
@@ -409,6 +794,7 @@ static void gopherDisconnected_GmRequest_(iGmRequest *d, iSocket *socket) {
         notify = iTrue;
     }
     unlock_Mutex(d->mtx);
+    connectionFinished_GmRequest_(d);
     if (notify) {
         iNotifyAudience(d, finished, GmRequestFinished);
     }
@@ -422,6 +808,7 @@ static void gopherError_GmRequest_(iGmRequest *d, iSocket *socket, int error, co
     format_String(&d->resp->meta, "%s (errno %d)", msg, error);
     clear_Block(&d->resp->body);
     unlock_Mutex(d->mtx);
+    connectionFinished_GmRequest_(d);
     iNotifyAudience(d, finished, GmRequestFinished);
 }
 
@@ -434,7 +821,9 @@ static void beginGopherConnection_GmRequest_(iGmRequest *d, const iString *host,
     d->gopher.meta   = &resp->meta;
     d->gopher.output = &resp->body;
     d->state         = receivingBody_GmRequestState;
-    d->gopher.socket = new_Socket(cstr_String(host), port);
+    iAddress *address = lookup_Resolver(host, port);
+    d->gopher.socket = newAddress_Socket(address);
+    iRelease(address);
     iConnect(Socket, d->gopher.socket, readyRead,    d, gopherRead_GmRequest_);
     iConnect(Socket, d->gopher.socket, disconnected, d, gopherDisconnected_GmRequest_);
     iConnect(Socket, d->gopher.socket, error,        d, gopherError_GmRequest_);
@@ -443,6 +832,7 @@ static void beginGopherConnection_GmRequest_(iGmRequest *d, const iString *host,
         resp->statusCode = input_GmStatusCode;
         setCStr_String(&resp->meta, "Enter query:");
         d->state = finished_GmRequestState;
+        connectionFinished_GmRequest_(d);
         iNotifyAudience(d, finished, GmRequestFinished);
     }
 }
@@ -452,6 +842,13 @@ static void beginGopherConnection_GmRequest_(iGmRequest *d, const iString *host,
 void init_GmRequest(iGmRequest *d, iGmCerts *certs) {
     d->mtx = new_Mutex();
     d->resp = new_GmResponse();
+    d->headerSize = 0;
+    d->submitTime = 0;
+    d->firstByteTime = 0;
+    d->priority = foreground_GmRequestPriority;
+    d->scheduleState = none_GmRequestScheduleState;
+    d->isStarting = iFalse;
+    init_String(&d->connectionHost);
     d->isRespLocked = iFalse;
     d->isRespFiltered = iFalse;
     set_Atomic(&d->allowUpdate, iTrue);
@@ -465,6 +862,12 @@ void init_GmRequest(iGmRequest *d, iGmCerts *certs) {
 }
 
 void deinit_GmRequest(iGmRequest *d) {
+    /* Release the request's place in the schedule first, so it won't be started any more.
+       A queued request never opens a connection. */
+    if (scheduleMutex_) {
+        iGuardMutex(scheduleMutex_, waitUntilStarted_GmRequest_(d));
+    }
+    unschedule_GmRequest_(d);
     if (d->req) {
         iDisconnectObject(TlsRequest, d->req, readyRead, d);
         iDisconnectObject(TlsRequest, d->req, finished, d);
@@ -478,6 +881,7 @@ void deinit_GmRequest(iGmRequest *d) {
     else {
         unlock_Mutex(d->mtx);
     }
+    postStartQueued_GmRequest_(); /* a slot may have been freed */
     iReleasePtr(&d->req);
     deinit_Gopher(&d->gopher);
     delete_Audience(d->finished);
@@ -485,6 +889,7 @@ void deinit_GmRequest(iGmRequest *d) {
 //    delete_GmResponse(d->respPub);
 //    deinit_GmResponse(&d->respInt);
     delete_GmResponse(d->resp);
+    deinit_String(&d->connectionHost);
     deinit_String(&d->url);
     delete_Mutex(d->mtx);
 }
@@ -494,11 +899,33 @@ void setUrl_GmRequest(iGmRequest *d, const iString *url) {
     urlEncodeSpaces_String(&d->url);
 }
 
+void setPriority_GmRequest(iGmRequest *d, enum iGmRequestPriority priority) {
+    iAssert(d->scheduleState == none_GmRequestScheduleState);
+    d->priority = priority;
+}
+
 void submit_GmRequest(iGmRequest *d) {
     iAssert(d->state == initialized_GmRequestState);
     if (d->state != initialized_GmRequestState) {
         return;
     }
+    /* Only requests that open network connections need to be scheduled. */
+    const iRangecc scheme = urlScheme_String(&d->url);
+    const iString *proxy  = schemeProxy_App(scheme);
+    if (proxy) {
+        set_String(&d->connectionHost, proxy);
+    }
+    else if (equalCase_Rangecc(scheme, "gemini") || equalCase_Rangecc(scheme, "gopher")) {
+        setRange_String(&d->connectionHost, urlHost_String(&d->url));
+    }
+    else {
+        start_GmRequest_(d);
+        return;
+    }
+    schedule_GmRequest_(d);
+}
+
+static void start_GmRequest_(iGmRequest *d) {
     set_Atomic(&d->allowUpdate, iTrue);
     iGmResponse *resp = d->resp;
     clear_GmResponse(resp);
@@ -541,7 +968,7 @@ void submit_GmRequest(iGmRequest *d) {
             if (endsWithCase_String(path, ".gmi") || endsWithCase_String(path, ".gemini")) {
                 setCStr_String(&resp->meta, "text/gemini; charset=utf-8");
             }
-            else if (endsWithCase_String(path, ".txt")) {
+            else if (endsWithCase_String(path, ".txt") || endsWithCase_String(path, ".log")) {
                 setCStr_String(&resp->meta, "text/plain");
             }
             else if (endsWithCase_String(path, ".png")) {
@@ -636,6 +1063,8 @@ void submit_GmRequest(iGmRequest *d) {
         return;
     }
     d->state = receivingHeader_GmRequestState;
+    /* Note: Each request does a full TLS handshake. TlsRequest owns the SSL connection and has
+       no way to save or reuse a session, so sessions cannot be resumed from here. */
     d->req = new_TlsRequest();
     const iGmIdentity *identity = identityForUrl_GmCerts(d->certs, &d->url);
     if (identity) {
@@ -649,10 +1078,20 @@ void submit_GmRequest(iGmRequest *d) {
     setUrl_TlsRequest(d->req, host, port);
     setContent_TlsRequest(d->req,
                           utf8_String(collectNewFormat_String("%s\r\n", cstr_String(&d->url))));
+    iGuardMutex(d->mtx, {
+        d->submitTime    = SDL_GetTicks();
+        d->firstByteTime = 0;
+    });
     submit_TlsRequest(d->req);
 }
 
 void cancel_GmRequest(iGmRequest *d) {
+    if (dequeue_GmRequest_(d)) {
+        /* Never started. */
+        iGuardMutex(d->mtx, d->state = finished_GmRequestState);
+        iNotifyAudience(d, finished, GmRequestFinished);
+        return;
+    }
     if (d->req) {
         cancel_TlsRequest(d->req);
     }
@@ -59,12 +59,23 @@ iGmResponse *       copy_GmResponse             (const iGmResponse *);
 iDeclareClass(GmRequest)
 iDeclareObjectConstructionArgs(GmRequest, iGmCerts *)
 
+/* Network requests are started in priority order. Foreground requests start immediately,
+   while others wait for free connection slots. */
+enum iGmRequestPriority {
+    background_GmRequestPriority, /* feeds, prefetching */
+    backgroundTab_GmRequestPriority,
+    media_GmRequestPriority,
+    foreground_GmRequestPriority, /* default */
+    max_GmRequestPriority
+};
+
 iDeclareNotifyFunc(GmRequest, Updated)
 iDeclareNotifyFunc(GmRequest, Finished)
 iDeclareAudienceGetter(GmRequest, updated)
 iDeclareAudienceGetter(GmRequest, finished)
 
 void                setUrl_GmRequest            (iGmRequest *, const iString *url);
+void                setPriority_GmRequest       (iGmRequest *, enum iGmRequestPriority priority);
 void                submit_GmRequest            (iGmRequest *);
 void                cancel_GmRequest            (iGmRequest *);
 
@@ -80,3 +91,9 @@ const iString *     url_GmRequest               (const iGmRequest *);
 
 int                 certFlags_GmRequest         (const iGmRequest *);
 iDate               certExpirationDate_GmRequest(const iGmRequest *);
+
+/* App-wide request scheduling and statistics about Gemini connections, per server. */
+void                initConnections_GmRequest   (void);
+void                deinitConnections_GmRequest (void);
+const iString *     debugInfo_GmRequest         (void);
+void                startQueued_GmRequest       (void); /* main thread only */
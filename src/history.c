@@ -22,13 +22,229 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "history.h"
 #include "app.h"
+#include "contentindex.h"
+#include "defs.h"
 
+#include <the_Foundation/buffer.h>
 #include <the_Foundation/file.h>
+#include <the_Foundation/fileinfo.h>
+#include <the_Foundation/intset.h>
 #include <the_Foundation/mutex.h>
+#include <the_Foundation/object.h>
 #include <the_Foundation/path.h>
+#include <the_Foundation/ptrarray.h>
 #include <the_Foundation/stringset.h>
+#include <stdio.h>
+
+static const size_t maxStack_History_         = 50; /* back/forward navigable items */
+static const size_t maxCachedBodySize_History_ = 4 * 1024 * 1024; /* larger ones are refetched */
+
+/* A cached response can be shared by any number of history items, e.g., when a tab is
+   duplicated. The body is implicitly shared with the request that received it, too.
+
+   The cached responses of all tabs share a memory budget. Bodies that haven't been viewed
+   recently are kept compressed, and the least recently viewed responses are dropped when
+   the budget is exceeded. This changes the response in place, so it is only accessed with
+   the cache mutex locked, and users get their own copy of it (see
+   cachedResponse_RecentUrl()). The copy shares the body, so it is cheap to make.
+
+   When the session is saved, each response is written once in its own file in the session
+   directory and the saved histories only refer to the file. Stored responses are read back
+   when they are first needed, which also applies to ones that were evicted from memory. */
+iDeclareClass(CachedResponse)
+
+struct Impl_CachedResponse {
+    iObject      object;
+    iGmResponse *response;         /* NULL if evicted or not loaded yet */
+    iBool        isCompressed;     /* response body is zlib-compressed */
+    iBool        isIncompressible; /* compressing doesn't save enough */
+    uint32_t     lastUsed;
+    uint32_t     storedId;         /* file in the session directory; zero if no response */
+    iBool        isStored;         /* file has been written */
+};
+
+static const size_t maxCacheSize_History_        = 64 * 1024 * 1024; /* all tabs */
+static const size_t maxUncompressedSize_History_ = 8 * 1024 * 1024;  /* most recently viewed */
+static const char * magicStored_History_         = "lgR1";
+
+static iMutex * cacheMutex_;
+static iPtrArray cache_; /* all CachedResponses; not owned */
+static uint32_t useCounter_;
+static iString * storeDir_;
+static uint32_t nextStoredId_;
+
+void initCache_History(const char *saveDir) {
+    cacheMutex_ = new_Mutex();
+    init_PtrArray(&cache_);
+    useCounter_ = 0;
+    storeDir_ = cleanedCStr_Path(concatPath_CStr(saveDir, "session")); /* used with stdio */
+    makeDirs_Path(storeDir_);
+    nextStoredId_ = 1;
+}
+
+void deinitCache_History(void) {
+    deinit_PtrArray(&cache_);
+    delete_String(storeDir_);
+    storeDir_ = NULL;
+    delete_Mutex(cacheMutex_);
+    cacheMutex_ = NULL;
+}
+
+static const char *storedPath_History_(uint32_t id) {
+    return concatPath_CStr(cstr_String(storeDir_), format_CStr("%08x.bin", id));
+}
+
+static void init_CachedResponse(iCachedResponse *d, iGmResponse *response) {
+    d->response         = response; /* takes ownership */
+    d->isCompressed     = iFalse;
+    d->isIncompressible = iFalse;
+    d->storedId         = 0;
+    d->isStored         = iFalse;
+    iGuardMutex(cacheMutex_, {
+        d->lastUsed = ++useCounter_;
+        if (response) {
+            d->storedId = nextStoredId_++; /* file name if the session gets saved */
+        }
+        pushBack_PtrArray(&cache_, d);
+    });
+}
+
+static void deinit_CachedResponse(iCachedResponse *d) {
+    iGuardMutex(cacheMutex_, removeOne_PtrArray(&cache_, d));
+    delete_GmResponse(d->response);
+}
+
+iDefineObjectConstructionArgs(CachedResponse, (iGmResponse *response), response)
+iDefineClass(CachedResponse)
+
+static size_t memorySize_CachedResponse_(const iCachedResponse *d) {
+    return d->response ? size_Block(&d->response->body) : 0;
+}
+
+static void compress_CachedResponse_(iCachedResponse *d) {
+#if defined (iHaveZlib)
+    if (d->response && !d->isCompressed && !d->isIncompressible) {
+        iBlock *zipped = compress_Block(&d->response->body);
+        if (size_Block(zipped) < size_Block(&d->response->body) * 9 / 10) {
+            set_Block(&d->response->body, zipped);
+            d->isCompressed = iTrue;
+        }
+        else {
+            d->isIncompressible = iTrue; /* probably an image or audio */
+        }
+        delete_Block(zipped);
+    }
+#else
+    iUnused(d);
+#endif
+}
+
+static void decompress_CachedResponse_(iCachedResponse *d) {
+#if defined (iHaveZlib)
+    if (d->response && d->isCompressed) {
+        iBlock *body = decompress_Block(&d->response->body);
+        set_Block(&d->response->body, body);
+        delete_Block(body);
+        d->isCompressed = iFalse;
+    }
+#else
+    iUnused(d);
+#endif
+}
+
+static iCachedResponse *newStored_CachedResponse_(uint32_t id) {
+    /* Copied histories may refer to the same file. */
+    iCachedResponse *existing = NULL;
+    iGuardMutex(cacheMutex_, {
+        iForEach(PtrArray, i, &cache_) {
+            iCachedResponse *cached = i.ptr;
+            if (cached->storedId == id) {
+                existing = cached;
+                break;
+            }
+        }
+    });
+    if (existing) {
+        return ref_Object(existing);
+    }
+    iCachedResponse *d = new_CachedResponse(NULL);
+    iGuardMutex(cacheMutex_, {
+        d->storedId   = id;
+        d->isStored   = iTrue;
+        nextStoredId_ = iMax(nextStoredId_, id + 1);
+    });
+    return d;
+}
 
-static const size_t maxStack_History_ = 50; /* back/forward navigable items */
+static iGmResponse *loadStored_CachedResponse_(uint32_t id, iBool *isCompressed) {
+    iGmResponse *resp = NULL;
+    iFile *f = newCStr_File(storedPath_History_(id));
+    if (open_File(f, readOnly_FileMode)) {
+        char magic[4];
+        readData_File(f, 4, magic);
+        const uint32_t version = readU32_File(f);
+        if (!memcmp(magic, magicStored_History_, 4) && version <= latest_FileVersion) {
+            setVersion_Stream(stream_File(f), version);
+            *isCompressed = read8_File(f) != 0;
+            resp = new_GmResponse();
+            deserialize_GmResponse(resp, stream_File(f));
+        }
+    }
+    iRelease(f);
+    return resp;
+}
+
+/* Returns a new block that the caller must delete. Cache mutex must be locked. */
+static iBlock *newBody_CachedResponse_(const iCachedResponse *d) {
+#if defined (iHaveZlib)
+    if (d->isCompressed) {
+        return decompress_Block(&d->response->body);
+    }
+#endif
+    return copy_Block(&d->response->body);
+}
+
+static int cmpUsedDescending_CachedResponsePtr_(const void *a, const void *b) {
+    const iCachedResponse *s = *(const void **) a, *t = *(const void **) b;
+    return (s->lastUsed < t->lastUsed) - (s->lastUsed > t->lastUsed);
+}
+
+static void trimCache_History_(void) {
+    size_t uncompressed = 0;
+    size_t total = 0;
+    lock_Mutex(cacheMutex_);
+    sort_Array(&cache_, cmpUsedDescending_CachedResponsePtr_);
+    iForEach(PtrArray, i, &cache_) {
+        iCachedResponse *cached = i.ptr;
+        if (!cached->response) {
+            continue;
+        }
+        if (!cached->isCompressed) {
+            if (uncompressed + memorySize_CachedResponse_(cached) <= maxUncompressedSize_History_) {
+                uncompressed += memorySize_CachedResponse_(cached);
+            }
+            else {
+                compress_CachedResponse_(cached);
+            }
+        }
+        total += memorySize_CachedResponse_(cached);
+    }
+    /* Drop the least recently used ones. */
+    iReverseForEach(PtrArray, j, &cache_) {
+        if (total <= maxCacheSize_History_) {
+            break;
+        }
+        iCachedResponse *cached = j.ptr;
+        if (cached->response) {
+            total -= memorySize_CachedResponse_(cached);
+            delete_GmResponse(cached->response);
+            cached->response = NULL;
+        }
+    }
+    unlock_Mutex(cacheMutex_);
+}
+
+/*----------------------------------------------------------------------------------------------*/
 
 void init_RecentUrl(iRecentUrl *d) {
     init_String(&d->url);
@@ -38,19 +254,74 @@ void init_RecentUrl(iRecentUrl *d) {
 
 void deinit_RecentUrl(iRecentUrl *d) {
     deinit_String(&d->url);
-    delete_GmResponse(d->cachedResponse);
+    iRelease(d->cachedResponse);
+}
+
+static void initCopy_RecentUrl_(iRecentUrl *d, const iRecentUrl *other) {
+    initCopy_String(&d->url, &other->url);
+    d->normScrollY    = other->normScrollY;
+    d->cachedResponse = other->cachedResponse ? ref_Object(other->cachedResponse) : NULL;
 }
 
 iDefineTypeConstruction(RecentUrl)
 
 iRecentUrl *copy_RecentUrl(const iRecentUrl *d) {
-    iRecentUrl *copy = new_RecentUrl();
-    set_String(&copy->url, &d->url);
-    copy->normScrollY = d->normScrollY;
-    copy->cachedResponse = d->cachedResponse ? copy_GmResponse(d->cachedResponse) : NULL;
+    iRecentUrl *copy = iMalloc(RecentUrl);
+    initCopy_RecentUrl_(copy, d);
     return copy;
 }
 
+iBool hasCachedResponse_RecentUrl(const iRecentUrl *d) {
+    iBool has = iFalse;
+    if (d->cachedResponse) {
+        iGuardMutex(cacheMutex_, {
+            has = d->cachedResponse->response || d->cachedResponse->isStored;
+        });
+    }
+    return has;
+}
+
+iGmResponse *cachedResponse_RecentUrl(const iRecentUrl *d) {
+    iCachedResponse *cached = d->cachedResponse;
+    if (!cached) {
+        return NULL;
+    }
+    iBool isChanged = iFalse;
+    iBool isLoadNeeded = iFalse;
+    iGuardMutex(cacheMutex_, isLoadNeeded = !cached->response && cached->isStored);
+    if (isLoadNeeded) {
+        /* Read it from the session directory. The file doesn't change once written. */
+        iBool        isCompressed = iFalse;
+        iGmResponse *loaded       = loadStored_CachedResponse_(cached->storedId, &isCompressed);
+        if (loaded) {
+            iGuardMutex(cacheMutex_, {
+                if (!cached->response) {
+                    cached->response     = loaded;
+                    cached->isCompressed = isCompressed;
+                    loaded               = NULL;
+                }
+            });
+            delete_GmResponse(loaded); /* someone else loaded it first */
+            isChanged = iTrue;
+        }
+    }
+    iGmResponse *resp = NULL;
+    iGuardMutex(cacheMutex_, {
+        if (cached->response) {
+            cached->lastUsed = ++useCounter_;
+            if (cached->isCompressed) {
+                decompress_CachedResponse_(cached);
+                isChanged = iTrue;
+            }
+            resp = copy_GmResponse(cached->response);
+        }
+    });
+    if (isChanged) {
+        trimCache_History_(); /* this one is now the most recently used */
+    }
+    return resp;
+}
+
 /*----------------------------------------------------------------------------------------------*/
 
 struct Impl_History {
@@ -79,7 +350,9 @@ iHistory *copy_History(const iHistory *d) {
     lock_Mutex(d->mtx);
     iHistory *copy = new_History();
     iConstForEach(Array, i, &d->recent) {
-        pushBack_Array(&copy->recent, copy_RecentUrl(i.value));
+        iRecentUrl item;
+        initCopy_RecentUrl_(&item, i.value);
+        pushBack_Array(&copy->recent, &item);
     }
     copy->recentPos = d->recentPos;
     unlock_Mutex(d->mtx);
@@ -94,9 +367,19 @@ void serialize_History(const iHistory *d, iStream *outs) {
         const iRecentUrl *item = i.value;
         serialize_String(&item->url, outs);
         write32_Stream(outs, item->normScrollY * 1.0e6f);
-        if (item->cachedResponse) {
+        /* Only a reference to the file; see new_CacheStore(). */
+        const iCachedResponse *cached   = item->cachedResponse;
+        uint32_t               storedId = 0;
+        if (cached) {
+            iGuardMutex(cacheMutex_, {
+                if (cached->response || cached->isStored) {
+                    storedId = cached->storedId;
+                }
+            });
+        }
+        if (storedId) {
             write8_Stream(outs, 1);
-            serialize_GmResponse(item->cachedResponse, outs);
+            writeU32_Stream(outs, storedId);
         }
         else {
             write8_Stream(outs, 0);
@@ -116,12 +399,20 @@ void deserialize_History(iHistory *d, iStream *ins) {
         deserialize_String(&item.url, ins);
         item.normScrollY = (float) read32_Stream(ins) / 1.0e6f;
         if (read8_Stream(ins)) {
-            item.cachedResponse = new_GmResponse();
-            deserialize_GmResponse(item.cachedResponse, ins);
+            if (version_Stream(ins) >= sessionResponseFiles_FileVersion) {
+                item.cachedResponse = newStored_CachedResponse_(readU32_Stream(ins));
+            }
+            else {
+                /* Older versions have the response inline. */
+                iGmResponse *resp = new_GmResponse();
+                deserialize_GmResponse(resp, ins);
+                item.cachedResponse = new_CachedResponse(resp);
+            }
         }
         pushBack_Array(&d->recent, &item);
     }
     unlock_Mutex(d->mtx);
+    trimCache_History_();
 }
 
 void clear_History(iHistory *d) {
@@ -235,22 +526,87 @@ iBool goForward_History(iHistory *d) {
     return iFalse;
 }
 
-const iGmResponse *cachedResponse_History(const iHistory *d) {
+iGmResponse *cachedResponse_History(const iHistory *d) {
     const iRecentUrl *item = constMostRecentUrl_History(d);
-    return item ? item->cachedResponse : NULL;
+    return item ? cachedResponse_RecentUrl(item) : NULL;
 }
 
 void setCachedResponse_History(iHistory *d, const iGmResponse *response) {
+    iString *indexedUrl = NULL;
     lock_Mutex(d->mtx);
     iRecentUrl *item = mostRecentUrl_History(d);
     if (item) {
-        delete_GmResponse(item->cachedResponse);
-        item->cachedResponse = NULL;
-        if (category_GmStatusCode(response->statusCode) == categorySuccess_GmStatusCode) {
-            item->cachedResponse = copy_GmResponse(response);
+        iReleasePtr(&item->cachedResponse);
+        if (category_GmStatusCode(response->statusCode) == categorySuccess_GmStatusCode &&
+            size_Block(&response->body) <= maxCachedBodySize_History_) {
+            item->cachedResponse = new_CachedResponse(copy_GmResponse(response));
+            indexedUrl = copy_String(&item->url);
         }
     }
     unlock_Mutex(d->mtx);
+    if (indexedUrl) {
+        add_ContentIndex(indexedUrl, &response->meta, &response->body);
+        delete_String(indexedUrl);
+    }
+    trimCache_History_();
+}
+
+size_t cacheSize_History(const iHistory *d) {
+    size_t size = 0;
+    lock_Mutex(d->mtx);
+    iGuardMutex(cacheMutex_, {
+        iConstForEach(Array, i, &d->recent) {
+            const iRecentUrl *item = i.value;
+            if (item->cachedResponse) {
+                size += memorySize_CachedResponse_(item->cachedResponse);
+            }
+        }
+    });
+    unlock_Mutex(d->mtx);
+    return size;
+}
+
+static iBool matchContent_History_(const iRegExp *pattern, const iBlock *body, const iString *url,
+                                   iString *entry) {
+    iRegExpMatch m;
+    init_RegExpMatch(&m);
+    if (!matchRange_RegExp(pattern, range_Block(body), &m)) {
+        return iFalse;
+    }
+    iRangei cap = m.range;
+    const int prefix = iMin(10, cap.start);
+    cap.start   = cap.start - prefix;
+    cap.end     = iMin(cap.end + 30, (int) size_Block(body));
+    const size_t maxLen = 60;
+    if (size_Range(&cap) > maxLen) {
+        cap.end = cap.start + maxLen;
+    }
+    iString content;
+    initRange_String(&content, (iRangecc){ m.subject + cap.start, m.subject + cap.end });
+    /* This needs cleaning up; highlight the matched word. */
+    replace_Block(&content.chars, '\n', ' ');
+    replace_Block(&content.chars, '\r', ' ');
+    if (prefix + size_Range(&m.range) < size_String(&content)) {
+        insertData_Block(&content.chars, prefix + size_Range(&m.range), uiText_ColorEscape, 2);
+    }
+    insertData_Block(&content.chars, prefix, uiTextStrong_ColorEscape, 2);
+    format_String(entry, "match len:%zu str:%s", size_String(&content), cstr_String(&content));
+    deinit_String(&content);
+    appendFormat_String(entry, " url:%s", cstr_String(url));
+    return iTrue;
+}
+
+const iString *searchResponse_History(const iRegExp *pattern, const iString *url,
+                                      const iGmResponse *resp) {
+    if (category_GmStatusCode(resp->statusCode) == categorySuccess_GmStatusCode &&
+        indexOfCStrSc_String(&resp->meta, "text/", &iCaseInsensitive) != iInvalidPos) {
+        iString *entry = new_String();
+        if (matchContent_History_(pattern, &resp->body, url, entry)) {
+            return collect_String(entry);
+        }
+        delete_String(entry);
+    }
+    return NULL;
 }
 
 const iStringArray *searchContents_History(const iHistory *d, const iRegExp *pattern) {
@@ -260,46 +616,146 @@ const iStringArray *searchContents_History(const iHistory *d, const iRegExp *pat
     init_StringSet(&inserted);
     iReverseConstForEach(Array, i, &d->recent) {
         const iRecentUrl *url = i.value;
-        const iGmResponse *resp = url->cachedResponse;
-        if (resp && category_GmStatusCode(resp->statusCode) == categorySuccess_GmStatusCode) {
-            if (indexOfCStrSc_String(&resp->meta, "text/", &iCaseInsensitive) == iInvalidPos) {
-                continue;
-            }
-            iRegExpMatch m;
-            init_RegExpMatch(&m);
-            if (matchRange_RegExp(pattern, range_Block(&resp->body), &m)) {
-                iString entry;
-                init_String(&entry);
-                iRangei cap = m.range;
-                const int prefix = iMin(10, cap.start);
-                cap.start   = cap.start - prefix;
-                cap.end     = iMin(cap.end + 30, (int) size_Block(&resp->body));
-                const size_t maxLen = 60;
-                if (size_Range(&cap) > maxLen) {
-                    cap.end = cap.start + maxLen;
+        iBlock *body = NULL; /* a shallow copy, or decompressed */
+        if (url->cachedResponse) {
+            iGuardMutex(cacheMutex_, {
+                const iGmResponse *resp = url->cachedResponse->response;
+                if (resp &&
+                    category_GmStatusCode(resp->statusCode) == categorySuccess_GmStatusCode &&
+                    indexOfCStrSc_String(&resp->meta, "text/", &iCaseInsensitive) != iInvalidPos) {
+                    body = newBody_CachedResponse_(url->cachedResponse);
                 }
-                iString content;
-                initRange_String(&content, (iRangecc){ m.subject + cap.start, m.subject + cap.end });
-                /* This needs cleaning up; highlight the matched word. */
-                replace_Block(&content.chars, '\n', ' ');
-                replace_Block(&content.chars, '\r', ' ');
-                if (prefix + size_Range(&m.range) < size_String(&content)) {
-                    insertData_Block(&content.chars, prefix + size_Range(&m.range), uiText_ColorEscape, 2);
-                }
-                insertData_Block(&content.chars, prefix, uiTextStrong_ColorEscape, 2);
-                format_String(
-                    &entry, "match len:%zu str:%s", size_String(&content), cstr_String(&content));
-                deinit_String(&content);
-                appendFormat_String(&entry, " url:%s", cstr_String(&url->url));
-                if (!contains_StringSet(&inserted, &url->url)) {
-                    pushFront_StringArray(urls, &entry);
-                    insert_StringSet(&inserted, &url->url);
-                }
-                deinit_String(&entry);
+            });
+        }
+        if (body) {
+            iString entry;
+            init_String(&entry);
+            if (matchContent_History_(pattern, body, &url->url, &entry) &&
+                !contains_StringSet(&inserted, &url->url)) {
+                pushFront_StringArray(urls, &entry);
+                insert_StringSet(&inserted, &url->url);
             }
+            deinit_String(&entry);
+            delete_Block(body);
         }
     }
     deinit_StringSet(&inserted);
     unlock_Mutex(d->mtx);
     return urls;
 }
+
+/*----------------------------------------------------------------------------------------------*/
+
+iDeclareType(CacheStoreItem)
+
+struct Impl_CacheStoreItem {
+    iCachedResponse *cached; /* ref */
+    iGmResponse *    response;
+    iBool            isCompressed;
+};
+
+struct Impl_CacheStore {
+    iArray  items;   /* not yet stored */
+    iIntSet usedIds; /* referenced by any history */
+    iString dir;
+};
+
+iDefineTypeConstruction(CacheStore)
+
+void init_CacheStore(iCacheStore *d) {
+    init_Array(&d->items, sizeof(iCacheStoreItem));
+    init_IntSet(&d->usedIds);
+    initCopy_String(&d->dir, storeDir_);
+    iGuardMutex(cacheMutex_, {
+        iForEach(PtrArray, i, &cache_) {
+            iCachedResponse *cached = i.ptr;
+            if (!cached->storedId) {
+                continue;
+            }
+            insert_IntSet(&d->usedIds, cached->storedId);
+            if (!cached->isStored && cached->response) {
+                /* The body is shared, not copied. */
+                const iCacheStoreItem item = { .cached       = ref_Object(cached),
+                                               .response     = copy_GmResponse(cached->response),
+                                               .isCompressed = cached->isCompressed };
+                pushBack_Array(&d->items, &item);
+            }
+        }
+    });
+}
+
+void deinit_CacheStore(iCacheStore *d) {
+    iForEach(Array, i, &d->items) {
+        iCacheStoreItem *item = i.value;
+        delete_GmResponse(item->response);
+        iRelease(item->cached);
+    }
+    deinit_Array(&d->items);
+    deinit_IntSet(&d->usedIds);
+    deinit_String(&d->dir);
+}
+
+static const char *itemPath_CacheStore_(const iCacheStore *d, uint32_t id, const char *ext) {
+    return concatPath_CStr(cstr_String(&d->dir), format_CStr("%08x.%s", id, ext));
+}
+
+static iBool writeItem_CacheStore_(const iCacheStore *d, const iCacheStoreItem *item) {
+    /* The response is written to a temporary file that replaces the stored one only when
+       it has been completely written. */
+    iBuffer *buf = new_Buffer();
+    openEmpty_Buffer(buf);
+    writeData_Stream(stream_Buffer(buf), magicStored_History_, 4);
+    writeU32_Stream(stream_Buffer(buf), latest_FileVersion);
+    write8_Stream(stream_Buffer(buf), item->isCompressed ? 1 : 0);
+    serialize_GmResponse(item->response, stream_Buffer(buf));
+    const iBlock *data      = data_Buffer(buf);
+    const char *  tempPath  = itemPath_CacheStore_(d, item->cached->storedId, "tmp");
+    const char *  path      = itemPath_CacheStore_(d, item->cached->storedId, "bin");
+    iBool         isWritten = iFalse;
+    iFile *       f         = newCStr_File(tempPath);
+    if (open_File(f, writeOnly_FileMode)) {
+        isWritten = writeData_File(f, constData_Block(data), size_Block(data)) == size_Block(data);
+    }
+    iRelease(f);
+    iRelease(buf);
+    if (isWritten) {
+#if defined (iPlatformMsys)
+        remove(path);
+#endif
+        isWritten = rename(tempPath, path) == 0;
+    }
+    if (!isWritten) {
+        remove(tempPath);
+    }
+    return isWritten;
+}
+
+void write_CacheStore(iCacheStore *d) {
+    iConstForEach(Array, i, &d->items) {
+        const iCacheStoreItem *item = i.value;
+        /* May be called in a background thread, so paths are released after each item. */
+        iBeginCollect();
+        if (writeItem_CacheStore_(d, item)) {
+            iGuardMutex(cacheMutex_, item->cached->isStored = iTrue);
+        }
+        iEndCollect();
+    }
+}
+
+void prune_CacheStore(const iCacheStore *d) {
+    /* May be called in a background thread, so nothing is collected. */
+    iFileInfo *   info = new_FileInfo(&d->dir);
+    iDirFileInfo *dir  = directoryContents_FileInfo(info);
+    iForEach(DirFileInfo, i, dir) {
+        const iFileInfo *entry = i.value;
+        unsigned int     id;
+        char             ext[4];
+        if (sscanf(baseName_Path(path_FileInfo(entry)).start, "%8x.%3s", &id, ext) == 2 &&
+            ((!iCmpStr(ext, "bin") && !contains_IntSet(&d->usedIds, id)) ||
+             !iCmpStr(ext, "tmp"))) {
+            remove(cstr_String(path_FileInfo(entry))); /* unused, or an unfinished write */
+        }
+    }
+    iRelease(dir);
+    iRelease(info);
+}
@@ -30,21 +30,28 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <the_Foundation/stringarray.h>
 #include <the_Foundation/time.h>
 
+iDeclareType(CachedResponse)
 iDeclareType(RecentUrl)
 iDeclareTypeConstruction(RecentUrl)
 
 struct Impl_RecentUrl {
-    iString      url;
-    float        normScrollY;    /* normalized to document height */
-    iGmResponse *cachedResponse; /* kept in memory for quicker back navigation */
+    iString          url;
+    float            normScrollY;    /* normalized to document height */
+    iCachedResponse *cachedResponse; /* kept in memory for quicker back navigation; shared */
 };
 
+iBool               hasCachedResponse_RecentUrl (const iRecentUrl *); /* in memory or stored */
+iGmResponse *       cachedResponse_RecentUrl    (const iRecentUrl *); /* caller gets a copy */
+
 /*----------------------------------------------------------------------------------------------*/
 
 iDeclareType(History)
 iDeclareTypeConstruction(History)
 iDeclareTypeSerialization(History)
 
+void        initCache_History           (const char *saveDir);
+void        deinitCache_History         (void);
+
 iHistory *  copy_History                (const iHistory *);
 
 void        clear_History               (iHistory *);
@@ -58,6 +65,8 @@ iRecentUrl *mostRecentUrl_History       (iHistory *);
 iRecentUrl *findUrl_History             (iHistory *, const iString *url);
 
 const iStringArray *   searchContents_History   (const iHistory *, const iRegExp *pattern); /* chronologically ascending */
+const iString *        searchResponse_History   (const iRegExp *pattern, const iString *url,
+                                                 const iGmResponse *resp); /* NULL if no match */
 
 const iString *
             url_History                 (const iHistory *, size_t pos);
@@ -65,6 +74,19 @@ const iRecentUrl *
             constRecentUrl_History      (const iHistory *d, size_t pos);
 const iRecentUrl *
             constMostRecentUrl_History  (const iHistory *);
-const iGmResponse *
-            cachedResponse_History      (const iHistory *);
+iGmResponse *
+            cachedResponse_History      (const iHistory *); /* caller gets a copy */
+size_t      cacheSize_History           (const iHistory *); /* bytes in memory */
+
+/*----------------------------------------------------------------------------------------------*/
+
+/* Cached responses to be written in the session directory. Constructing a CacheStore takes a
+   snapshot of the responses that serialized histories refer to but that haven't been written
+   yet; the files can then be written in a background thread. Only one CacheStore may be
+   written at a time. */
+iDeclareType(CacheStore)
+iDeclareTypeConstruction(CacheStore)
+
+void        write_CacheStore            (iCacheStore *);
+void        prune_CacheStore            (const iCacheStore *); /* remove unreferenced files */
 
@@ -27,10 +27,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "audio/player.h"
 #include "app.h"
 
+#include <the_Foundation/mutex.h>
 #include <the_Foundation/ptrarray.h>
+#include <the_Foundation/thread.h>
 #include <stb_image.h>
+#include <SDL_cpuinfo.h>
 #include <SDL_hints.h>
 #include <SDL_render.h>
+#include <SDL_timer.h>
 
 iDeclareType(GmMediaProps)
 
@@ -52,52 +56,405 @@ static void deinit_GmMediaProps_(iGmMediaProps *d) {
 
 /*----------------------------------------------------------------------------------------------*/
 
+/* Images are decoded in a pool of background threads so that a large image doesn't block
+   the UI. Only the texture upload is done in the main thread. */
+
+enum iImageDecodeState {
+    queued_ImageDecodeState,
+    running_ImageDecodeState,
+    finished_ImageDecodeState,
+    cancelled_ImageDecodeState,
+};
+
+iDeclareType(ImageDecode)
+iDeclareType(ImageDecoder)
+
+struct Impl_ImageDecode {
+    enum iImageDecodeState state;
+    iBlock   data;
+    iBool    isPartial; /* data is incomplete; decode as much as possible */
+    int      maxWidth;  /* image is scaled down to this width (0: no limit) */
+    iInt2    size;
+    uint8_t *pixels;    /* RGBA; owned by the job until taken */
+};
+
+static iImageDecode *new_ImageDecode_(const iBlock *data, iBool isPartial, int maxWidth) {
+    iImageDecode *d = iMalloc(ImageDecode);
+    d->state     = queued_ImageDecodeState;
+    initCopy_Block(&d->data, data);
+    d->isPartial = isPartial;
+    d->maxWidth  = maxWidth;
+    d->size     = zero_I2();
+    d->pixels   = NULL;
+    return d;
+}
+
+static void delete_ImageDecode_(iImageDecode *d) {
+    if (d) {
+        deinit_Block(&d->data);
+        stbi_image_free(d->pixels);
+        free(d);
+    }
+}
+
+#define maxThreads_ImageDecoder_    4
+
+struct Impl_ImageDecoder {
+    iMutex *   mtx;
+    iCondition jobAvailable;
+    iPtrArray  queue;
+    iThread *  threads[maxThreads_ImageDecoder_];
+    int        numThreads;
+    iBool      isStopping;
+};
+
+static iImageDecoder decoder_;
+
+/* Box filter that averages all the source pixels covered by each destination pixel.
+   The result is allocated with malloc(), like stbi's own buffers. */
+static uint8_t *downscale_(const uint8_t *src, iInt2 srcSize, iInt2 dstSize) {
+    uint8_t *dst = malloc(4 * (size_t) dstSize.x * dstSize.y);
+    for (int y = 0; y < dstSize.y; y++) {
+        const int y0 = y * srcSize.y / dstSize.y;
+        const int y1 = iMax(y0 + 1, (y + 1) * srcSize.y / dstSize.y);
+        for (int x = 0; x < dstSize.x; x++) {
+            const int x0 = x * srcSize.x / dstSize.x;
+            const int x1 = iMax(x0 + 1, (x + 1) * srcSize.x / dstSize.x);
+            uint32_t sum[4] = { 0, 0, 0, 0 };
+            for (int sy = y0; sy < y1; sy++) {
+                const uint8_t *p = src + 4 * ((size_t) sy * srcSize.x + x0);
+                for (int sx = x0; sx < x1; sx++, p += 4) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    sum[3] += p[3];
+                }
+            }
+            const uint32_t count = (y1 - y0) * (x1 - x0);
+            uint8_t *out = dst + 4 * ((size_t) y * dstSize.x + x);
+            for (int c = 0; c < 4; c++) {
+                out[c] = sum[c] / count;
+            }
+        }
+    }
+    return dst;
+}
+
+static iBool isJpeg_(const iBlock *data) {
+    static const char jpegStart_[] = { '\xff', '\xd8' };
+    return size_Block(data) > 2 && !memcmp(constData_Block(data), jpegStart_, 2);
+}
+
+static void terminatePartial_ImageDecode_(iImageDecode *d) {
+    /* stbi doesn't decode truncated files. A JPEG can be made complete by ending it with an
+       EOI marker: the missing blocks are filled in as gray, and a progressive JPEG shows the
+       scans received so far. Other formats can only be shown when complete. */
+    static const char jpegEnd_[] = { '\xff', '\xd9' };
+    if (isJpeg_(&d->data)) {
+        appendData_Block(&d->data, jpegEnd_, 2);
+    }
+}
+
+static iThreadResult run_ImageDecoder_(iThread *thread) {
+    iImageDecoder *d = &decoder_;
+    iUnused(thread);
+    lock_Mutex(d->mtx);
+    while (!d->isStopping) {
+        if (isEmpty_PtrArray(&d->queue)) {
+            wait_Condition(&d->jobAvailable, d->mtx);
+            continue;
+        }
+        iImageDecode *job;
+        take_PtrArray(&d->queue, 0, (void **) &job);
+        job->state = running_ImageDecodeState;
+        unlock_Mutex(d->mtx);
+        if (job->isPartial) {
+            terminatePartial_ImageDecode_(job);
+        }
+        iInt2 size = zero_I2();
+        uint8_t *pixels = stbi_load_from_memory(
+            constData_Block(&job->data), size_Block(&job->data), &size.x, &size.y, NULL, 4);
+        if (pixels && job->maxWidth > 0 && size.x > job->maxWidth) {
+            /* No point in keeping more pixels than can be shown. */
+            const iInt2 scaled = init_I2(job->maxWidth,
+                                         iMax(1, (int) ((int64_t) size.y * job->maxWidth / size.x)));
+            uint8_t *scaledPixels = downscale_(pixels, size, scaled);
+            stbi_image_free(pixels);
+            pixels = scaledPixels;
+            size   = scaled;
+        }
+        lock_Mutex(d->mtx);
+        if (job->state == cancelled_ImageDecodeState) {
+            /* The image was deleted while we were busy. */
+            stbi_image_free(pixels);
+            delete_ImageDecode_(job);
+            continue;
+        }
+        clear_Block(&job->data);
+        job->pixels = pixels;
+        job->size   = pixels ? size : zero_I2();
+        job->state  = finished_ImageDecodeState;
+        postCommand_App("media.decoded");
+    }
+    unlock_Mutex(d->mtx);
+    return 0;
+}
+
+/* Textures of all documents share one memory budget. Only accessed in the main thread. */
+static const size_t   maxTextureBytes_Media_ = 256 * 1024 * 1024;
+static const uint32_t inUseTimeMs_Media_     = 1000; /* recently drawn; probably on screen */
+static iPtrArray      texturedImages_;
+static size_t         textureBytes_;
+
+void initDecoders_Media(void) {
+    iImageDecoder *d = &decoder_;
+    init_PtrArray(&texturedImages_);
+    textureBytes_ = 0;
+    d->mtx = new_Mutex();
+    init_Condition(&d->jobAvailable);
+    init_PtrArray(&d->queue);
+    d->isStopping = iFalse;
+    d->numThreads = iClamp(SDL_GetCPUCount() - 1, 1, maxThreads_ImageDecoder_);
+    for (int i = 0; i < d->numThreads; i++) {
+        d->threads[i] = new_Thread(run_ImageDecoder_);
+        start_Thread(d->threads[i]);
+    }
+}
+
+void deinitDecoders_Media(void) {
+    iImageDecoder *d = &decoder_;
+    iGuardMutex(d->mtx, {
+        d->isStopping = iTrue;
+        signalAll_Condition(&d->jobAvailable);
+    });
+    for (int i = 0; i < d->numThreads; i++) {
+        join_Thread(d->threads[i]);
+        iRelease(d->threads[i]);
+    }
+    iForEach(PtrArray, i, &d->queue) {
+        delete_ImageDecode_(i.ptr);
+    }
+    deinit_PtrArray(&d->queue);
+    deinit_Condition(&d->jobAvailable);
+    delete_Mutex(d->mtx);
+    d->mtx = NULL;
+    iAssert(isEmpty_PtrArray(&texturedImages_));
+    deinit_PtrArray(&texturedImages_);
+}
+
+static iImageDecode *submit_ImageDecoder_(iImageDecoder *d, const iBlock *data, iBool isPartial,
+                                          int maxWidth) {
+    iImageDecode *job = new_ImageDecode_(data, isPartial, maxWidth);
+    iGuardMutex(d->mtx, {
+        pushBack_PtrArray(&d->queue, job);
+        signal_Condition(&d->jobAvailable);
+    });
+    return job;
+}
+
+static void cancel_ImageDecoder_(iImageDecoder *d, iImageDecode *job) {
+    iGuardMutex(d->mtx, {
+        if (job->state == running_ImageDecodeState) {
+            job->state = cancelled_ImageDecodeState; /* worker will delete it */
+        }
+        else {
+            if (job->state == queued_ImageDecodeState) {
+                removeOne_PtrArray(&d->queue, job);
+            }
+            delete_ImageDecode_(job);
+        }
+    });
+}
+
+/* Returns the decoded pixels (caller must free them) if the job has finished. */
+static iBool takeFinished_ImageDecoder_(iImageDecoder *d, iImageDecode *job, uint8_t **pixels_out,
+                                        iInt2 *size_out) {
+    iBool isFinished = iFalse;
+    iGuardMutex(d->mtx, {
+        if (job->state == finished_ImageDecodeState) {
+            *pixels_out = job->pixels;
+            *size_out   = job->size;
+            job->pixels = NULL;
+            isFinished  = iTrue;
+        }
+    });
+    return isFinished;
+}
+
+/*----------------------------------------------------------------------------------------------*/
+
 iDeclareType(GmImage)
 
 struct Impl_GmImage {
     iGmMediaProps props;
-    iBlock        partialData; /* cleared when image is converted to texture */
-    iInt2         size;
+    iBlock        data;     /* encoded image; kept for decoding again at a different size */
+    iInt2         size;     /* original size of the image */
     size_t        numBytes;
+    iImageDecode *decode;   /* pending decode; NULL when done */
     SDL_Texture * texture;
+    iInt2         texSize;  /* may be smaller than the image */
+    uint32_t      lastUsed; /* when the texture was last drawn */
+    iBool         isPartial;
+    iBool         isStale;  /* texture was decoded from older data */
+    uint32_t      dataTime; /* when partial data was last taken */
 };
 
 void init_GmImage(iGmImage *d, const iBlock *data) {
     init_GmMediaProps_(&d->props);
-    initCopy_Block(&d->partialData, data);
+    initCopy_Block(&d->data, data);
     d->size     = zero_I2();
     d->numBytes = 0;
+    d->decode   = NULL;
     d->texture  = NULL;
+    d->texSize   = zero_I2();
+    d->lastUsed  = 0;
+    d->isPartial = iFalse;
+    d->isStale   = iFalse;
+    d->dataTime  = 0;
+}
+
+static size_t textureBytes_GmImage_(const iGmImage *d) {
+    return 4 * (size_t) d->texSize.x * d->texSize.y;
+}
+
+static void releaseTexture_GmImage_(iGmImage *d) {
+    if (d->texture) {
+        SDL_DestroyTexture(d->texture);
+        d->texture = NULL;
+        textureBytes_ -= textureBytes_GmImage_(d);
+        d->texSize = zero_I2();
+        removeOne_PtrArray(&texturedImages_, d);
+    }
+}
+
+static void evictTextures_GmImage_(const iGmImage *except) {
+    /* Textures that haven't been drawn recently are off-screen or in hidden tabs.
+       They can be decoded again if needed. */
+    const uint32_t now = SDL_GetTicks();
+    while (textureBytes_ > maxTextureBytes_Media_) {
+        iGmImage *oldest = NULL;
+        iForEach(PtrArray, i, &texturedImages_) {
+            iGmImage *img = i.ptr;
+            if (img == except || now - img->lastUsed < inUseTimeMs_Media_) {
+                continue;
+            }
+            if (!oldest || img->lastUsed < oldest->lastUsed) {
+                oldest = img;
+            }
+        }
+        if (!oldest) {
+            break; /* everything is in use */
+        }
+        releaseTexture_GmImage_(oldest);
+    }
+}
+
+static void cancelDecode_GmImage_(iGmImage *d) {
+    if (d->decode) {
+        cancel_ImageDecoder_(&decoder_, d->decode);
+        d->decode = NULL;
+    }
 }
 
 void deinit_GmImage(iGmImage *d) {
-    deinit_Block(&d->partialData);
-    SDL_DestroyTexture(d->texture);
+    cancelDecode_GmImage_(d);
+    releaseTexture_GmImage_(d);
+    deinit_Block(&d->data);
     deinit_GmMediaProps_(&d->props);
 }
 
-void makeTexture_GmImage(iGmImage *d) {
-    iBlock *data     = &d->partialData;
-    d->numBytes      = size_Block(data);
-    uint8_t *imgData = stbi_load_from_memory(
-        constData_Block(data), size_Block(data), &d->size.x, &d->size.y, NULL, 4);
+static const uint32_t previewIntervalMs_GmImage_ = 500;
+
+/* Returns True if the size of the image changed. */
+static iBool setData_GmImage_(iGmImage *d, const iBlock *data, iBool isPartial) {
+    const uint32_t now = SDL_GetTicks();
+    /* Only JPEGs can be decoded before they are complete (see terminatePartial_ImageDecode_). */
+    const iBool isPreview = isPartial && isJpeg_(data);
+    if (isPartial && d->isPartial &&
+        (!isPreview || d->decode || now - d->dataTime < previewIntervalMs_GmImage_)) {
+        /* Previews are updated at a limited rate. */
+        return iFalse;
+    }
+    const iInt2 oldSize = d->size;
+    cancelDecode_GmImage_(d);
+    if (isPartial) {
+        /* The response body is still growing. If it were shared, it would get copied on
+           every append, so the data received so far is copied once here instead. */
+        if (isPreview) {
+            setData_Block(&d->data, constData_Block(data), size_Block(data));
+        }
+        else {
+            clear_Block(&d->data); /* the header is enough for now */
+        }
+    }
+    else {
+        set_Block(&d->data, data);
+    }
+    d->numBytes  = size_Block(data);
+    d->isPartial = isPartial;
+    d->isStale   = iTrue;
+    d->dataTime  = now;
+    /* The header tells the size, so the layout doesn't need to wait for the pixels.
+       Decoding happens when the image is drawn. */
+    if (!stbi_info_from_memory(
+            constData_Block(data), size_Block(data), &d->size.x, &d->size.y, NULL)) {
+        d->size = zero_I2();
+        clear_Block(&d->data);
+        releaseTexture_GmImage_(d);
+    }
+    return !isEqual_I2(oldSize, d->size);
+}
+
+static void requestTexture_GmImage_(iGmImage *d, int displayWidth) {
+    if (d->decode || isEmpty_Block(&d->data)) {
+        return;
+    }
+    int wanted = displayWidth > 0 ? iMin(displayWidth, d->size.x) : d->size.x;
+    if (d->isPartial) {
+        wanted = iMax(1, wanted / 2); /* low-resolution preview */
+    }
+    /* Decode again if there is new data, or if the image is shown larger than the texture,
+       or much smaller. */
+    if (!d->texture || d->isStale || d->texSize.x < wanted || d->texSize.x > 2 * wanted) {
+        d->decode  = submit_ImageDecoder_(&decoder_, &d->data, d->isPartial, wanted);
+        d->isStale = iFalse;
+    }
+}
+
+static iBool makeTexture_GmImage_(iGmImage *d) {
+    uint8_t *imgData = NULL;
+    iInt2    imgSize;
+    if (!d->decode || !takeFinished_ImageDecoder_(&decoder_, d->decode, &imgData, &imgSize)) {
+        return iFalse;
+    }
+    cancelDecode_GmImage_(d); /* deletes the finished job */
     if (!imgData) {
-        d->size    = zero_I2();
-        d->texture = NULL;
+        if (!d->isPartial) {
+            releaseTexture_GmImage_(d);
+            clear_Block(&d->data); /* don't try again */
+        }
+        /* A preview may not be possible until more data has arrived. */
     }
     else {
+        releaseTexture_GmImage_(d);
         /* TODO: Save some memory by checking if the alpha channel is actually in use. */
-        /* TODO: Resize down to min(maximum texture size, window size). */
         SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(
-            imgData, d->size.x, d->size.y, 32, d->size.x * 4, SDL_PIXELFORMAT_ABGR8888);
+            imgData, imgSize.x, imgSize.y, 32, imgSize.x * 4, SDL_PIXELFORMAT_ABGR8888);
         /* TODO: In multiwindow case, all windows must have the same shared renderer?
            Or at least a shared context. */
         SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"); /* linear scaling */
         d->texture = SDL_CreateTextureFromSurface(renderer_Window(get_Window()), surface);
         SDL_FreeSurface(surface);
         stbi_image_free(imgData);
+        if (d->texture) {
+            d->texSize  = imgSize;
+            d->lastUsed = SDL_GetTicks();
+            textureBytes_ += textureBytes_GmImage_(d);
+            pushBack_PtrArray(&texturedImages_, d);
+            evictTextures_GmImage_(d);
+        }
     }
-    clear_Block(data);
+    return iTrue;
 }
 
 iDefineTypeConstructionArgs(GmImage, (const iBlock *data), data)
@@ -170,9 +527,8 @@ iBool setData_Media(iMedia *d, iGmLinkId linkId, const iString *mime, const iBlo
         else {
             img = at_PtrArray(&d->images, existing - 1);
             iAssert(equal_String(&img->props.mime, mime)); /* MIME cannot change */
-            set_Block(&img->partialData, data);
-            if (!isPartial) {
-                makeTexture_GmImage(img);
+            if (setData_GmImage_(img, data, isPartial)) {
+                isNew = iTrue; /* needs layout */
             }
         }
     }
@@ -197,15 +553,18 @@ iBool setData_Media(iMedia *d, iGmLinkId linkId, const iString *mime, const iBlo
     }
     else if (!isDeleting) {
         if (startsWith_String(mime, "image/")) {
-            /* Copy the image to a texture. */
-            iGmImage *img = new_GmImage(data);
+            int width, height;
+            if (isPartial &&
+                !stbi_info_from_memory(
+                    constData_Block(data), size_Block(data), &width, &height, NULL)) {
+                return iFalse; /* the final size must be known for the layout */
+            }
+            iGmImage *img = new_GmImage(collect_Block(new_Block(0)));
             img->props.linkId = linkId; /* TODO: use a hash? */
             img->props.isPermanent = !allowHide;
             set_String(&img->props.mime, mime);
             pushBack_PtrArray(&d->images, img);
-            if (!isPartial) {
-                makeTexture_GmImage(img);
-            }
+            setData_GmImage_(img, data, isPartial);
             isNew = iTrue;
         }
         else if (startsWith_String(mime, "audio/")) {
@@ -227,6 +586,16 @@ iBool setData_Media(iMedia *d, iGmLinkId linkId, const iString *mime, const iBlo
     return isNew;
 }
 
+iBool updateDecoded_Media(iMedia *d) {
+    iBool isChanged = iFalse;
+    iForEach(PtrArray, i, &d->images) {
+        if (makeTexture_GmImage_(i.ptr)) {
+            isChanged = iTrue;
+        }
+    }
+    return isChanged;
+}
+
 iMediaId findLinkImage_Media(const iMedia *d, iGmLinkId linkId) {
     /* TODO: use a hash */
     iConstForEach(PtrArray, i, &d->images) {
@@ -242,6 +611,18 @@ size_t numAudio_Media(const iMedia *d) {
     return size_PtrArray(&d->audio);
 }
 
+size_t memorySize_Media(const iMedia *d) {
+    size_t size = 0;
+    iConstForEach(PtrArray, i, &d->images) {
+        const iGmImage *img = i.ptr;
+        size += size_Block(&img->data);
+        if (img->texture) {
+            size += 4 * img->texSize.x * img->texSize.y;
+        }
+    }
+    return size;
+}
+
 iMediaId findLinkAudio_Media(const iMedia *d, iGmLinkId linkId) {
     /* TODO: use a hash */
     iConstForEach(PtrArray, i, &d->audio) {
@@ -253,14 +634,23 @@ iMediaId findLinkAudio_Media(const iMedia *d, iGmLinkId linkId) {
     return 0;
 }
 
-SDL_Texture *imageTexture_Media(const iMedia *d, uint16_t imageId) {
+SDL_Texture *imageTexture_Media(iMedia *d, iMediaId imageId, int displayWidth) {
     if (imageId > 0 && imageId <= size_PtrArray(&d->images)) {
-        const iGmImage *img = constAt_PtrArray(&d->images, imageId - 1);
+        iGmImage *img = at_PtrArray(&d->images, imageId - 1);
+        img->lastUsed = SDL_GetTicks();
+        requestTexture_GmImage_(img, displayWidth);
         return img->texture;
     }
     return NULL;
 }
 
+void markImageUsed_Media(iMedia *d, iMediaId imageId) {
+    if (imageId > 0 && imageId <= size_PtrArray(&d->images)) {
+        iGmImage *img = at_PtrArray(&d->images, imageId - 1);
+        img->lastUsed = SDL_GetTicks();
+    }
+}
+
 iBool imageInfo_Media(const iMedia *d, iMediaId imageId, iGmImageInfo *info_out) {
     if (imageId > 0 && imageId <= size_PtrArray(&d->images)) {
         const iGmImage *img   = constAt_PtrArray(&d->images, imageId - 1);
@@ -318,6 +708,7 @@ void init_MediaRequest(iMediaRequest *d, iDocumentWidget *doc, unsigned int link
     d->linkId = linkId;
     d->req    = new_GmRequest(certs_App());
     setUrl_GmRequest(d->req, url);
+    setPriority_GmRequest(d->req, media_GmRequestPriority);
     iConnect(GmRequest, d->req, updated, d, updated_MediaRequest_);
     iConnect(GmRequest, d->req, finished, d, finished_MediaRequest_);
     submit_GmRequest(d->req);
@@ -53,14 +53,20 @@ enum iMediaFlags {
     partialData_MediaFlag = iBit(2),
 };
 
+void    initDecoders_Media      (void);
+void    deinitDecoders_Media    (void);
+
 void    clear_Media     (iMedia *);
 iBool   setData_Media   (iMedia *, uint16_t linkId, const iString *mime, const iBlock *data, int flags);
+iBool   updateDecoded_Media (iMedia *); /* called on "media.decoded" */
 
 iMediaId        findLinkImage_Media (const iMedia *, uint16_t linkId);
 iBool           imageInfo_Media     (const iMedia *, iMediaId imageId, iGmImageInfo *info_out);
-SDL_Texture *   imageTexture_Media  (const iMedia *, iMediaId imageId);
+SDL_Texture *   imageTexture_Media  (iMedia *, iMediaId imageId, int displayWidth);
+void            markImageUsed_Media (iMedia *, iMediaId imageId);
 
 size_t          numAudio_Media      (const iMedia *);
+size_t          memorySize_Media    (const iMedia *); /* image data and textures */
 iMediaId        findLinkAudio_Media (const iMedia *, uint16_t linkId);
 iBool           audioInfo_Media     (const iMedia *, iMediaId audioId, iGmAudioInfo *info_out);
 iPlayer *       audioPlayer_Media   (const iMedia *, iMediaId audioId);
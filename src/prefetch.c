@@ -0,0 +1,305 @@
+/* Copyright 2020 Jaakko Keränen <jaakko.keranen@iki.fi>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "prefetch.h"
+#include "app.h"
+
+#include <the_Foundation/ptrarray.h>
+#include <SDL_timer.h>
+
+iDeclareType(Prefetch)
+iDeclareType(PrefetchEntry)
+
+struct Impl_PrefetchEntry {
+    iString      url;
+    iString      host;
+    iGmRequest * request;  /* while being fetched */
+    iGmResponse *response; /* when finished */
+    uint32_t     time;     /* SDL ticks: when queued or finished */
+};
+
+static void init_PrefetchEntry(iPrefetchEntry *d, const iString *url) {
+    initCopy_String(&d->url, url);
+    initRange_String(&d->host, urlHost_String(url));
+    d->request  = NULL;
+    d->response = NULL;
+    d->time     = SDL_GetTicks();
+}
+
+static void deinit_PrefetchEntry(iPrefetchEntry *d) {
+    if (d->request) {
+        cancel_GmRequest(d->request);
+        iRelease(d->request);
+    }
+    delete_GmResponse(d->response);
+    deinit_String(&d->host);
+    deinit_String(&d->url);
+}
+
+iDefineTypeConstructionArgs(PrefetchEntry, (const iString *url), url)
+
+/*----------------------------------------------------------------------------------------------*/
+
+static const size_t   maxConcurrent_Prefetch_   = 2;
+static const size_t   maxQueued_Prefetch_       = 16;
+static const size_t   maxBodySize_Prefetch_     = 512 * 1024; /* larger ones are not kept */
+static const size_t   maxTotalSize_Prefetch_    = 4 * 1024 * 1024;
+static const uint32_t hostIntervalMs_Prefetch_  = 1000; /* between requests to the same host */
+static const uint32_t expiryMs_Prefetch_        = 5 * 60 * 1000;
+
+struct Impl_Prefetch {
+    iPtrArray entries; /* oldest first */
+    iPtrArray hostTimes; /* recent request start times per host (iPrefetchEntry without data) */
+    int       timer;
+};
+
+static iPrefetch prefetch_;
+
+static void finished_Prefetch_(iAnyObject *request) {
+    iUnused(request);
+    postCommand_App("prefetch.update");
+}
+
+static uint32_t postUpdate_Prefetch_(uint32_t interval, void *data) {
+    iUnused(interval, data);
+    prefetch_.timer = 0;
+    postCommand_App("prefetch.update");
+    return 0;
+}
+
+static iPrefetchEntry *find_Prefetch_(const iPrefetch *d, const iString *url) {
+    iConstForEach(PtrArray, i, &d->entries) {
+        iPrefetchEntry *entry = i.ptr;
+        if (equal_String(&entry->url, url)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static size_t numFetching_Prefetch_(const iPrefetch *d) {
+    size_t count = 0;
+    iConstForEach(PtrArray, i, &d->entries) {
+        const iPrefetchEntry *entry = i.ptr;
+        if (entry->request) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static size_t totalSize_Prefetch_(const iPrefetch *d) {
+    size_t size = 0;
+    iConstForEach(PtrArray, i, &d->entries) {
+        const iPrefetchEntry *entry = i.ptr;
+        if (entry->response) {
+            size += size_Block(&entry->response->body);
+        }
+    }
+    return size;
+}
+
+static iPrefetchEntry *hostTime_Prefetch_(iPrefetch *d, const iString *host) {
+    iForEach(PtrArray, i, &d->hostTimes) {
+        iPrefetchEntry *ht = i.ptr;
+        if (equalCase_String(&ht->host, host)) {
+            return ht;
+        }
+    }
+    return NULL;
+}
+
+static void remove_Prefetch_(iPrefetch *d, size_t index) {
+    iPrefetchEntry *entry;
+    take_PtrArray(&d->entries, index, (void **) &entry);
+    delete_PrefetchEntry(entry);
+}
+
+static void removeExpired_Prefetch_(iPrefetch *d, uint32_t now) {
+    for (size_t i = 0; i < size_PtrArray(&d->entries); ) {
+        const iPrefetchEntry *entry = constAt_PtrArray(&d->entries, i);
+        if (entry->response && now - entry->time > expiryMs_Prefetch_) {
+            remove_Prefetch_(d, i);
+        }
+        else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < size_PtrArray(&d->hostTimes); ) {
+        iPrefetchEntry *ht = at_PtrArray(&d->hostTimes, i);
+        if (now - ht->time > hostIntervalMs_Prefetch_) {
+            remove_Array(&d->hostTimes, i);
+            delete_PrefetchEntry(ht);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+static void collectFinished_Prefetch_(iPrefetch *d) {
+    for (size_t i = 0; i < size_PtrArray(&d->entries); ) {
+        iPrefetchEntry *entry = at_PtrArray(&d->entries, i);
+        if (entry->request && isFinished_GmRequest(entry->request)) {
+            iGmRequest *req = entry->request;
+            entry->request = NULL;
+            iDisconnect(GmRequest, req, finished, req, finished_Prefetch_);
+            const iGmResponse *resp = lockResponse_GmRequest(req);
+            if (isSuccess_GmStatusCode(resp->statusCode) &&
+                startsWithCase_String(&resp->meta, "text/") &&
+                size_Block(&resp->body) <= maxBodySize_Prefetch_) {
+                entry->response = copy_GmResponse(resp);
+                entry->time     = SDL_GetTicks();
+            }
+            unlockResponse_GmRequest(req);
+            iRelease(req);
+            if (!entry->response) {
+                remove_Prefetch_(d, i);
+                continue;
+            }
+        }
+        i++;
+    }
+    /* Keep within the size budget by dropping the oldest responses. */
+    size_t total = totalSize_Prefetch_(d);
+    for (size_t i = 0; total > maxTotalSize_Prefetch_ && i < size_PtrArray(&d->entries); ) {
+        const iPrefetchEntry *entry = constAt_PtrArray(&d->entries, i);
+        if (entry->response) {
+            total -= size_Block(&entry->response->body);
+            remove_Prefetch_(d, i);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+static void startQueued_Prefetch_(iPrefetch *d, uint32_t now) {
+    uint32_t retryMs = 0;
+    iForEach(PtrArray, i, &d->entries) {
+        if (numFetching_Prefetch_(d) >= maxConcurrent_Prefetch_) {
+            break;
+        }
+        iPrefetchEntry *entry = i.ptr;
+        if (entry->request || entry->response) {
+            continue;
+        }
+        iPrefetchEntry *ht = hostTime_Prefetch_(d, &entry->host);
+        if (ht) {
+            /* Don't overload the server. */
+            const uint32_t wait = hostIntervalMs_Prefetch_ - (now - ht->time);
+            retryMs = retryMs ? iMin(retryMs, wait) : wait;
+            continue;
+        }
+        ht = new_PrefetchEntry(&entry->url);
+        pushBack_PtrArray(&d->hostTimes, ht);
+        entry->request = new_GmRequest(certs_App());
+        setUrl_GmRequest(entry->request, &entry->url);
+        setPriority_GmRequest(entry->request, background_GmRequestPriority);
+        iConnect(GmRequest, entry->request, finished, entry->request, finished_Prefetch_);
+        submit_GmRequest(entry->request);
+    }
+    if (retryMs && !d->timer) {
+        d->timer = SDL_AddTimer(iMax(1u, retryMs), postUpdate_Prefetch_, NULL);
+    }
+}
+
+void init_Prefetch(void) {
+    iPrefetch *d = &prefetch_;
+    init_PtrArray(&d->entries);
+    init_PtrArray(&d->hostTimes);
+    d->timer = 0;
+}
+
+void deinit_Prefetch(void) {
+    iPrefetch *d = &prefetch_;
+    if (d->timer) {
+        SDL_RemoveTimer(d->timer);
+        d->timer = 0;
+    }
+    cancelAll_Prefetch();
+    iForEach(PtrArray, i, &d->hostTimes) {
+        delete_PrefetchEntry(i.ptr);
+    }
+    deinit_PtrArray(&d->hostTimes);
+    deinit_PtrArray(&d->entries);
+}
+
+iBool submit_Prefetch(const iString *url) {
+    iPrefetch *d = &prefetch_;
+    if (find_Prefetch_(d, url)) {
+        return iFalse;
+    }
+    size_t numQueued = 0;
+    iConstForEach(PtrArray, i, &d->entries) {
+        const iPrefetchEntry *entry = i.ptr;
+        if (!entry->response) {
+            numQueued++;
+        }
+    }
+    if (numQueued >= maxQueued_Prefetch_) {
+        return iFalse;
+    }
+    pushBack_PtrArray(&d->entries, new_PrefetchEntry(url));
+    update_Prefetch();
+    return iTrue;
+}
+
+void cancelAll_Prefetch(void) {
+    iPrefetch *d = &prefetch_;
+    iForEach(PtrArray, i, &d->entries) {
+        iPrefetchEntry *entry = i.ptr;
+        if (entry->request) {
+            iDisconnect(GmRequest, entry->request, finished, entry->request, finished_Prefetch_);
+        }
+        delete_PrefetchEntry(entry);
+    }
+    clear_PtrArray(&d->entries);
+}
+
+iGmResponse *take_Prefetch(const iString *url) {
+    iPrefetch *d = &prefetch_;
+    collectFinished_Prefetch_(d);
+    removeExpired_Prefetch_(d, SDL_GetTicks());
+    for (size_t i = 0; i < size_PtrArray(&d->entries); i++) {
+        iPrefetchEntry *entry = at_PtrArray(&d->entries, i);
+        if (equal_String(&entry->url, url)) {
+            /* Unfinished prefetches are cancelled; the caller will fetch the URL itself. */
+            iGmResponse *resp = entry->response;
+            entry->response = NULL;
+            if (entry->request) {
+                iDisconnect(GmRequest, entry->request, finished, entry->request, finished_Prefetch_);
+            }
+            remove_Prefetch_(d, i);
+            return resp;
+        }
+    }
+    return NULL;
+}
+
+void update_Prefetch(void) {
+    iPrefetch *d = &prefetch_;
+    const uint32_t now = SDL_GetTicks();
+    collectFinished_Prefetch_(d);
+    removeExpired_Prefetch_(d, now);
+    startQueued_Prefetch_(d, now);
+}
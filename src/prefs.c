@@ -33,6 +33,8 @@ void init_Prefs(iPrefs *d) {
     d->hoverOutline      = iFalse;
     d->smoothScrolling   = iTrue;
     d->loadImageInsteadOfScrolling = iFalse;
+    d->maxImageFetches   = 0;
+    d->prefetchCount     = 0;
     d->font              = nunito_TextFont;
     d->headingFont       = nunito_TextFont;
     d->monospaceGemini   = iFalse;
@@ -43,6 +45,7 @@ void init_Prefs(iPrefs *d) {
     d->docThemeDark      = colorfulDark_GmDocumentTheme;
     d->docThemeLight     = white_GmDocumentTheme;
     d->saturation        = 1.0f;
+    initCStr_String(&d->prefetchPattern, "next|older|previous");
     init_String(&d->geminiProxy);
     init_String(&d->gopherProxy);
     init_String(&d->httpProxy);
@@ -50,6 +53,7 @@ void init_Prefs(iPrefs *d) {
 }
 
 void deinit_Prefs(iPrefs *d) {
+    deinit_String(&d->prefetchPattern);
     deinit_String(&d->geminiProxy);
     deinit_String(&d->gopherProxy);
     deinit_String(&d->httpProxy);
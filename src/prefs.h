@@ -47,7 +47,10 @@ struct Impl_Prefs {
     iBool            hoverOutline;
     iBool            smoothScrolling;
     iBool            loadImageInsteadOfScrolling;
+    int              maxImageFetches; /* images near the viewport loaded automatically at once */
     /* Network */
+    int              prefetchCount; /* links fetched in advance; zero to disable */
+    iString          prefetchPattern; /* preferred link labels, separated by "|" */
     iString          geminiProxy;
     iString          gopherProxy;
     iString          httpProxy;
@@ -0,0 +1,150 @@
+/* Copyright 2020 Jaakko Keränen <jaakko.keranen@iki.fi>
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "resolver.h"
+
+#include <the_Foundation/array.h>
+#include <the_Foundation/mutex.h>
+#include <SDL_timer.h>
+
+iDeclareType(Resolver)
+iDeclareType(ResolverEntry)
+
+struct Impl_ResolverEntry {
+    iString   hostName;
+    uint16_t  port;
+    uint32_t  startedAt; /* SDL ticks */
+    iAddress *address;
+};
+
+static void deinit_ResolverEntry_(iResolverEntry *d) {
+    deinit_String(&d->hostName);
+    iRelease(d->address);
+}
+
+/*----------------------------------------------------------------------------------------------*/
+
+static const uint32_t validTimeMs_Resolver_   = 5 * 60 * 1000;
+static const uint32_t invalidTimeMs_Resolver_ = 30 * 1000;
+static const size_t   maxEntries_Resolver_    = 64;
+
+struct Impl_Resolver {
+    iMutex *mtx;
+    iArray  entries;
+};
+
+static iResolver resolver_;
+
+static void clear_Resolver_(void);
+
+static iBool isExpired_ResolverEntry_(const iResolverEntry *d, uint32_t now) {
+    if (isPending_Address(d->address)) {
+        return iFalse; /* waiting for the lookup to finish */
+    }
+    const uint32_t elapsed = now - d->startedAt;
+    return elapsed > (isValid_Address(d->address) ? validTimeMs_Resolver_ : invalidTimeMs_Resolver_);
+}
+
+static void removeExpired_Resolver_(iResolver *d, uint32_t now) {
+    for (size_t i = 0; i < size_Array(&d->entries); ) {
+        iResolverEntry *entry = at_Array(&d->entries, i);
+        if (isExpired_ResolverEntry_(entry, now)) {
+            deinit_ResolverEntry_(entry);
+            remove_Array(&d->entries, i);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+static void removeOldest_Resolver_(iResolver *d) {
+    size_t oldest = iInvalidPos;
+    iConstForEach(Array, i, &d->entries) {
+        const iResolverEntry *entry = i.value;
+        if (isPending_Address(entry->address)) {
+            continue;
+        }
+        if (oldest == iInvalidPos ||
+            entry->startedAt < ((const iResolverEntry *) constAt_Array(&d->entries, oldest))->startedAt) {
+            oldest = index_ArrayConstIterator(&i);
+        }
+    }
+    if (oldest != iInvalidPos) {
+        deinit_ResolverEntry_(at_Array(&d->entries, oldest));
+        remove_Array(&d->entries, oldest);
+    }
+}
+
+void init_Resolver(void) {
+    iResolver *d = &resolver_;
+    d->mtx = new_Mutex();
+    init_Array(&d->entries, sizeof(iResolverEntry));
+}
+
+void deinit_Resolver(void) {
+    iResolver *d = &resolver_;
+    clear_Resolver_();
+    deinit_Array(&d->entries);
+    delete_Mutex(d->mtx);
+    d->mtx = NULL;
+}
+
+static void clear_Resolver_(void) {
+    iResolver *d = &resolver_;
+    iGuardMutex(d->mtx, {
+        iForEach(Array, i, &d->entries) {
+            deinit_ResolverEntry_(i.value);
+        }
+        clear_Array(&d->entries);
+    });
+}
+
+iAddress *lookup_Resolver(const iString *hostName, uint16_t port) {
+    iResolver *d = &resolver_;
+    iAddress *address = NULL;
+    lock_Mutex(d->mtx);
+    const uint32_t now = SDL_GetTicks();
+    removeExpired_Resolver_(d, now);
+    iConstForEach(Array, i, &d->entries) {
+        const iResolverEntry *entry = i.value;
+        if (entry->port == port && equalCase_String(&entry->hostName, hostName)) {
+            address = ref_Object(entry->address);
+            break;
+        }
+    }
+    if (!address) {
+        if (size_Array(&d->entries) >= maxEntries_Resolver_) {
+            removeOldest_Resolver_(d);
+        }
+        iResolverEntry entry;
+        initCopy_String(&entry.hostName, hostName);
+        entry.port      = port;
+        entry.startedAt = now;
+        entry.address   = new_Address();
+        lookupTcp_Address(entry.address, hostName, port);
+        pushBack_Array(&d->entries, &entry);
+        address = ref_Object(entry.address);
+    }
+    unlock_Mutex(d->mtx);
+    return address;
+}
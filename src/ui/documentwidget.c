@@ -24,8 +24,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "app.h"
 #include "audio/player.h"
+#include "charsetdecoder.h"
 #include "command.h"
 #include "defs.h"
+#include "diskcache.h"
 #include "gmcerts.h"
 #include "gmdocument.h"
 #include "gmrequest.h"
@@ -38,6 +40,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "media.h"
 #include "paint.h"
 #include "playerui.h"
+#include "prefetch.h"
 #include "scrollwidget.h"
 #include "util.h"
 #include "visbuf.h"
@@ -106,10 +109,70 @@ struct Impl_OutlineItem {
     iRect    rect;
 };
 
+iDeclareType(ImageFetch)
+
+struct Impl_ImageFetch {
+    iGmLinkId linkId;
+    int       docY; /* position of the link in the document */
+};
+
+/* Recently viewed documents are kept laid out, with their media, for quick back/forward
+   navigation. */
+iDeclareType(RetainedDocument)
+
+struct Impl_RetainedDocument {
+    iString      url;
+    iGmDocument *doc;
+    int          docWidth; /* scroll position is exact if the width hasn't changed */
+    int          scrollY;
+    float        normScrollY;
+    iString      sourceMime;
+    iString      sourceMeta;
+    iBlock       sourceContent;
+    iTime        sourceTime;
+    int          certFlags;
+    iBlock       certFingerprint;
+    iDate        certExpiry;
+    iString      certSubject;
+};
+
+static void init_RetainedDocument(iRetainedDocument *d) {
+    init_String(&d->url);
+    d->doc         = NULL;
+    d->docWidth    = 0;
+    d->scrollY     = 0;
+    d->normScrollY = 0.0f;
+    init_String(&d->sourceMime);
+    init_String(&d->sourceMeta);
+    init_Block(&d->sourceContent, 0);
+    iZap(d->sourceTime);
+    d->certFlags = 0;
+    init_Block(&d->certFingerprint, 0);
+    iZap(d->certExpiry);
+    init_String(&d->certSubject);
+}
+
+static void deinit_RetainedDocument(iRetainedDocument *d) {
+    deinit_String(&d->certSubject);
+    deinit_Block(&d->certFingerprint);
+    deinit_Block(&d->sourceContent);
+    deinit_String(&d->sourceMeta);
+    deinit_String(&d->sourceMime);
+    iRelease(d->doc);
+    deinit_String(&d->url);
+}
+
+iDefineTypeConstruction(RetainedDocument)
+
+static const size_t maxRetained_DocumentWidget_ = 3;
+
 /*----------------------------------------------------------------------------------------------*/
 
 static void animatePlayers_DocumentWidget_      (iDocumentWidget *d);
 static void updateSideIconBuf_DocumentWidget_   (iDocumentWidget *d);
+static void updateImageFetches_DocumentWidget_  (iDocumentWidget *d);
+static void detachRetained_DocumentWidget_      (iDocumentWidget *d);
+static iImageFetch *findImageFetch_DocumentWidget_(iDocumentWidget *d, iGmLinkId linkId);
 
 static const int smoothDuration_DocumentWidget_  = 600; /* milliseconds */
 static const int outlineMinWidth_DocumentWdiget_ = 45;  /* times gap_UI */
@@ -127,6 +190,9 @@ enum iDocumentWidgetFlag {
     selecting_DocumentWidgetFlag             = iBit(1),
     noHoverWhileScrolling_DocumentWidgetFlag = iBit(2),
     showLinkNumbers_DocumentWidgetFlag       = iBit(3),
+    pendingRestore_DocumentWidgetFlag        = iBit(4), /* loaded when shown */
+    hibernated_DocumentWidgetFlag            = iBit(5), /* only compressed source kept */
+    savedCopy_DocumentWidgetFlag             = iBit(6), /* from disk cache; couldn't connect */
 };
 
 enum iDocumentLinkOrdinalMode {
@@ -141,12 +207,18 @@ struct Impl_DocumentWidget {
     int            flags;
     enum iDocumentLinkOrdinalMode ordinalMode;
     iString *      titleUser;
+    iString *      placeholderTitle; /* saved title, until restored */
     iGmRequest *   request;
     iAtomicInt     isRequestUpdated; /* request has new content, need to parse it */
     iObjectList *  media;
+    iArray         imageFetches; /* images loaded automatically; not retried if failed */
+    iPtrArray      retained;     /* iRetainedDocument; most recent last */
     iString        sourceMime;
+    iString        sourceMeta;    /* complete response meta, for rebuilding the document */
     iBlock         sourceContent; /* original content as received, for saving */
     iTime          sourceTime;
+    iTime          hiddenSince;   /* invalid while the tab is shown */
+    iCharsetDecoder *charsetDecoder; /* for the request in progress */
     iGmDocument *  doc;
     int            certFlags;
     iBlock *       certFingerprint;
@@ -201,9 +273,12 @@ void init_DocumentWidget(iDocumentWidget *d) {
     d->certSubject      = new_String();
     d->state            = blank_RequestState;
     d->titleUser        = new_String();
+    d->placeholderTitle = new_String();
     d->request          = NULL;
     d->isRequestUpdated = iFalse;
     d->media            = new_ObjectList();
+    init_Array(&d->imageFetches, sizeof(iImageFetch));
+    init_PtrArray(&d->retained);
     d->doc              = new_GmDocument();
     d->redirectCount    = 0;
     d->initNormScrollY  = 0;
@@ -223,8 +298,11 @@ void init_DocumentWidget(iDocumentWidget *d) {
     init_Anim(&d->sideOpacity, 0);
     init_Anim(&d->outlineOpacity, 0);
     init_String(&d->sourceMime);
+    init_String(&d->sourceMeta);
     init_Block(&d->sourceContent, 0);
     iZap(d->sourceTime);
+    initCurrent_Time(&d->hiddenSince);
+    d->charsetDecoder = NULL;
     init_PtrArray(&d->visibleLinks);
     init_PtrArray(&d->visibleWideRuns);
     init_Array(&d->wideRunOffsets, sizeof(int));
@@ -260,10 +338,17 @@ void deinit_DocumentWidget(iDocumentWidget *d) {
     delete_PtrSet(d->invalidRuns);
     deinit_Array(&d->outline);
     iRelease(d->media);
+    deinit_Array(&d->imageFetches);
+    iForEach(PtrArray, i, &d->retained) {
+        delete_RetainedDocument(i.ptr);
+    }
+    deinit_PtrArray(&d->retained);
     iRelease(d->request);
     deinit_String(&d->pendingGotoHeading);
     deinit_Block(&d->sourceContent);
+    deinit_String(&d->sourceMeta);
     deinit_String(&d->sourceMime);
+    delete_CharsetDecoder(d->charsetDecoder);
     iRelease(d->doc);
     if (d->playerTimer) {
         SDL_RemoveTimer(d->playerTimer);
@@ -275,6 +360,7 @@ void deinit_DocumentWidget(iDocumentWidget *d) {
     delete_Block(d->certFingerprint);
     delete_String(d->certSubject);
     delete_String(d->titleUser);
+    delete_String(d->placeholderTitle);
     deinit_PersistentDocumentState(&d->mod);
 }
 
@@ -364,11 +450,21 @@ static void addVisible_DocumentWidget_(void *context, const iGmRun *run) {
     if (run->audioId) {
         pushBack_PtrArray(&d->visiblePlayers, run);
     }
+    if (run->imageId) {
+        markImageUsed_Media(media_GmDocument(d->doc), run->imageId);
+    }
     if (run->linkId && linkFlags_GmDocument(d->doc, run->linkId) & supportedProtocol_GmLinkFlag) {
         pushBack_PtrArray(&d->visibleLinks, run);
     }
 }
 
+static void markImageUsed_DocumentWidget_(void *context, const iGmRun *run) {
+    iDocumentWidget *d = context;
+    if (run->imageId) {
+        markImageUsed_Media(media_GmDocument(d->doc), run->imageId);
+    }
+}
+
 static float normScrollPos_DocumentWidget_(const iDocumentWidget *d) {
     const int docSize = size_GmDocument(d->doc).y;
     if (docSize) {
@@ -573,6 +669,13 @@ static void updateVisible_DocumentWidget_(iDocumentWidget *d) {
     clear_PtrArray(&d->visibleLinks);
     clear_PtrArray(&d->visibleWideRuns);
     clear_PtrArray(&d->visiblePlayers);
+    if (updateLayoutRange_GmDocument(d->doc, visRange)) {
+        /* Runs of a large document were recreated for the new position. */
+        clear_PtrSet(d->invalidRuns);
+        d->hoverLink      = NULL;
+        d->contextLink    = NULL;
+        d->lastVisibleRun = NULL;
+    }
     const iRangecc oldHeading = currentHeading_DocumentWidget_(d);
     /* Scan for visible runs. */ {
         d->firstVisibleRun = NULL;
@@ -585,6 +688,7 @@ static void updateVisible_DocumentWidget_(iDocumentWidget *d) {
     updateHover_DocumentWidget_(d, mouseCoord_Window(get_Window()));
     updateSideOpacity_DocumentWidget_(d, iTrue);
     animatePlayers_DocumentWidget_(d);
+    updateImageFetches_DocumentWidget_(d);
     /* Remember scroll positions of recently visited pages. */ {
         iRecentUrl *recent = mostRecentUrl_History(d->mod.history);
         if (recent && docSize && d->state == ready_RequestState) {
@@ -603,6 +707,9 @@ static void updateWindowTitle_DocumentWidget_(const iDocumentWidget *d) {
     if (!isEmpty_String(title_GmDocument(d->doc))) {
         pushBack_StringArray(title, title_GmDocument(d->doc));
     }
+    else if (d->flags & pendingRestore_DocumentWidgetFlag && !isEmpty_String(d->placeholderTitle)) {
+        pushBack_StringArray(title, d->placeholderTitle);
+    }
     if (!isEmpty_String(d->titleUser)) {
         pushBack_StringArray(title, d->titleUser);
     }
@@ -725,9 +832,11 @@ static void updateOutline_DocumentWidget_(iDocumentWidget *d) {
     }
 }
 
-static void setSource_DocumentWidget_(iDocumentWidget *d, const iString *source) {
+static void setSource_DocumentWidget_(iDocumentWidget *d, const iString *source,
+                                      enum iGmDocumentUpdate updateType) {
+    detachRetained_DocumentWidget_(d);
     setUrl_GmDocument(d->doc, d->mod.url);
-    setSource_GmDocument(d->doc, source, documentWidth_DocumentWidget_(d));
+    setSource_GmDocument(d->doc, source, documentWidth_DocumentWidget_(d), updateType);
     d->foundMark       = iNullRange;
     d->selectMark      = iNullRange;
     d->hoverLink       = NULL;
@@ -755,6 +864,9 @@ static void updateTheme_DocumentWidget_(iDocumentWidget *d) {
 }
 
 static enum iGmDocumentBanner bannerType_DocumentWidget_(const iDocumentWidget *d) {
+    if (d->flags & savedCopy_DocumentWidgetFlag) {
+        return savedCopy_GmDocumentBanner;
+    }
     if (d->certFlags & available_GmCertFlag) {
         const int req = domainVerified_GmCertFlag | timeVerified_GmCertFlag | trusted_GmCertFlag;
         if ((d->certFlags & req) != req) {
@@ -771,6 +883,7 @@ static void showErrorPage_DocumentWidget_(iDocumentWidget *d, enum iGmStatusCode
     appendChar_String(src, msg->icon ? msg->icon : 0x2327); /* X in a box */
     appendFormat_String(src, " %s\n%s", msg->title, msg->info);
     iBool useBanner = iTrue;
+    detachRetained_DocumentWidget_(d);
     if (meta) {
         switch (code) {
             case schemeChangeRedirect_GmStatusCode:
@@ -806,7 +919,7 @@ static void showErrorPage_DocumentWidget_(iDocumentWidget *d, enum iGmStatusCode
     }
     setBanner_GmDocument(d->doc, useBanner ? bannerType_DocumentWidget_(d) : none_GmDocumentBanner);
     setFormat_GmDocument(d->doc, gemini_GmDocumentFormat);
-    setSource_DocumentWidget_(d, src);
+    setSource_DocumentWidget_(d, src, final_GmDocumentUpdate);
     updateTheme_DocumentWidget_(d);
     init_Anim(&d->scrollY, 0);
     init_Anim(&d->sideOpacity, 0);
@@ -845,8 +958,10 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
             updateTheme_DocumentWidget_(d);
         }
         clear_String(&d->sourceMime);
+        clear_String(&d->sourceMeta);
         d->sourceTime = response->when;
         updateTimestampBuf_DocumentWidget_(d);
+        /* Shares the body; released before the response is unlocked. */
         initBlock_String(&str, &response->body);
         if (isSuccess_GmStatusCode(statusCode)) {
             /* Check the MIME type. */
@@ -854,6 +969,7 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
             enum iGmDocumentFormat docFormat = undefined_GmDocumentFormat;
             const iString *mimeStr = collect_String(lower_String(&response->meta)); /* for convenience */
             set_String(&d->sourceMime, mimeStr);
+            set_String(&d->sourceMeta, &response->meta);
             iRangecc mime = range_String(mimeStr);
             iRangecc seg = iNullRange;
             while (nextSplit_Rangecc(mime, ";", &seg)) {
@@ -874,7 +990,8 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
                     /* Make a simple document with an image or audio player. */
                     docFormat = gemini_GmDocumentFormat;
                     setRange_String(&d->sourceMime, param);
-                    if ((isAudio && isInitialUpdate) || (!isAudio && isRequestFinished)) {
+                    if (!isAudio || isInitialUpdate) {
+                        /* Images are shown progressively as data arrives. */
                         const char *linkTitle =
                             startsWith_String(mimeStr, "image/") ? "Image" : "Audio";
                         iUrl parts;
@@ -891,7 +1008,7 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
                                       !isRequestFinished ? partialData_MediaFlag : 0);
                         redoLayout_GmDocument(d->doc);
                     }
-                    else if (isAudio && !isInitialUpdate) {
+                    else {
                         /* Update the audio content. */
                         setData_Media(media_GmDocument(d->doc),
                                       1,
@@ -901,9 +1018,6 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
                         refresh_Widget(d);
                         setSource = iFalse;
                     }
-                    else {
-                        clear_String(&str);
-                    }
                 }
                 else if (startsWith_Rangecc(param, "charset=")) {
                     charset = (iRangecc){ param.start + 8, param.end };
@@ -916,6 +1030,8 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
                 }
             }
             if (docFormat == undefined_GmDocumentFormat) {
+                delete_CharsetDecoder(d->charsetDecoder);
+                d->charsetDecoder = NULL;
                 showErrorPage_DocumentWidget_(d, unsupportedMimeType_GmStatusCode, &response->meta);
                 deinit_String(&str);
                 return;
@@ -923,12 +1039,31 @@ static void updateDocument_DocumentWidget_(iDocumentWidget *d, const iGmResponse
             setFormat_GmDocument(d->doc, docFormat);
             /* Convert the source to UTF-8 if needed. */
             if (!equalCase_Rangecc(charset, "utf-8")) {
-                set_String(&str,
-                           collect_String(decode_Block(&str.chars, cstr_Rangecc(charset))));
+                if (isInitialUpdate || !d->charsetDecoder) {
+                    delete_CharsetDecoder(d->charsetDecoder);
+                    d->charsetDecoder = new_CharsetDecoder(cstr_Rangecc(charset));
+                }
+                if (isValid_CharsetDecoder(d->charsetDecoder)) {
+                    /* Only the newly received part is decoded. */
+                    set_String(&str,
+                               decode_CharsetDecoder(
+                                   d->charsetDecoder, &response->body, isRequestFinished));
+                }
+                else {
+                    set_String(&str,
+                               collect_String(decode_Block(&str.chars, cstr_Rangecc(charset))));
+                }
+                if (isRequestFinished) {
+                    delete_CharsetDecoder(d->charsetDecoder);
+                    d->charsetDecoder = NULL;
+                }
             }
         }
         if (setSource) {
-            setSource_DocumentWidget_(d, &str);
+            setSource_DocumentWidget_(d,
+                                      &str,
+                                      isRequestFinished ? final_GmDocumentUpdate
+                                                        : partial_GmDocumentUpdate);
         }
         deinit_String(&str);
     }
@@ -940,14 +1075,20 @@ static void fetch_DocumentWidget_(iDocumentWidget *d) {
         iRelease(d->request);
         d->request = NULL;
     }
+    /* A prefetched copy of the page is superseded by the new request. */
+    delete_GmResponse(take_Prefetch(d->mod.url));
     postCommandf_App("document.request.started doc:%p url:%s", d, cstr_String(d->mod.url));
     clear_ObjectList(d->media);
+    clear_Array(&d->imageFetches);
     d->certFlags = 0;
-    d->flags &= ~showLinkNumbers_DocumentWidgetFlag;
+    d->flags &= ~(showLinkNumbers_DocumentWidgetFlag | savedCopy_DocumentWidgetFlag);
     d->state = fetching_RequestState;
     set_Atomic(&d->isRequestUpdated, iFalse);
     d->request = new_GmRequest(certs_App());
     setUrl_GmRequest(d->request, d->mod.url);
+    setPriority_GmRequest(d->request,
+                          document_App() == d ? foreground_GmRequestPriority
+                                              : backgroundTab_GmRequestPriority);
     iConnect(GmRequest, d->request, updated, d, requestUpdated_DocumentWidget_);
     iConnect(GmRequest, d->request, finished, d, requestFinished_DocumentWidget_);
     submit_GmRequest(d->request);
@@ -995,28 +1136,271 @@ static void parseUser_DocumentWidget_(iDocumentWidget *d) {
     }
 }
 
-static iBool updateFromHistory_DocumentWidget_(iDocumentWidget *d) {
+static void prefetchLinks_DocumentWidget_(iDocumentWidget *d) {
+    const iPrefs *prefs = prefs_App();
+    if (prefs->prefetchCount <= 0 || document_App() != d ||
+        !equalCase_Rangecc(urlScheme_String(d->mod.url), "gemini")) {
+        return;
+    }
+    const iString *host  = collect_String(newRange_String(urlHost_String(d->mod.url)));
+    const size_t   count = numLinks_GmDocument(d->doc);
+    int            numSubmitted = 0;
+    /* Links with a preferred label come first, then other links on the same host. */
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t linkId = 1; linkId <= count && numSubmitted < prefs->prefetchCount; linkId++) {
+            const int flags = linkFlags_GmDocument(d->doc, linkId);
+            if (~flags & gemini_GmLinkFlag ||
+                flags & (imageFileExtension_GmLinkFlag | audioFileExtension_GmLinkFlag)) {
+                continue;
+            }
+            const iString *url = linkUrl_GmDocument(d->doc, linkId);
+            if (equal_String(url, d->mod.url)) {
+                continue;
+            }
+            iBool isPreferred = iFalse;
+            const iRangecc label = linkLabel_GmDocument(d->doc, linkId);
+            if (!isEmpty_Range(&label)) {
+                const iString *labelStr = collect_String(newRange_String(label));
+                iRangecc word = iNullRange;
+                while (nextSplit_Rangecc(range_String(&prefs->prefetchPattern), "|", &word)) {
+                    iRangecc trimmed = word;
+                    trim_Rangecc(&trimmed);
+                    if (!isEmpty_Range(&trimmed) &&
+                        indexOfCStrSc_String(labelStr, cstr_Rangecc(trimmed), &iCaseInsensitive) !=
+                            iInvalidPos) {
+                        isPreferred = iTrue;
+                        break;
+                    }
+                }
+            }
+            if (pass == 0 ? isPreferred
+                          : !isPreferred && equalCase_Rangecc(urlHost_String(url), cstr_String(host))) {
+                if (submit_Prefetch(url)) {
+                    numSubmitted++;
+                }
+            }
+        }
+    }
+}
+
+static void updateFromCachedResponse_DocumentWidget_(iDocumentWidget *d, float normScrollY,
+                                                     const iGmResponse *resp) {
+    clear_ObjectList(d->media);
+    clear_Array(&d->imageFetches);
+    detachRetained_DocumentWidget_(d);
+    reset_GmDocument(d->doc);
+    d->state = fetching_RequestState;
+    d->initNormScrollY = normScrollY;
+    resetWideRuns_DocumentWidget_(d);
+    /* Use the cached response data. */
+    updateTrust_DocumentWidget_(d, resp);
+    d->sourceTime = resp->when;
+    updateTimestampBuf_DocumentWidget_(d);
+    set_Block(&d->sourceContent, &resp->body);
+    updateDocument_DocumentWidget_(d, resp, iTrue);
+    init_Anim(&d->scrollY, d->initNormScrollY * size_GmDocument(d->doc).y);
+    d->state = ready_RequestState;
+    updateSideOpacity_DocumentWidget_(d, iFalse);
+    updateSideIconBuf_DocumentWidget_(d);
+    updateOutline_DocumentWidget_(d);
+    updateVisible_DocumentWidget_(d);
+    postCommandf_App("document.changed doc:%p url:%s", d, cstr_String(d->mod.url));
+}
+
+static iBool updateFromPrefetch_DocumentWidget_(iDocumentWidget *d) {
+    iGmResponse *resp = take_Prefetch(d->mod.url);
+    if (!resp) {
+        return iFalse;
+    }
+    updateFromCachedResponse_DocumentWidget_(d, 0.0f, resp);
+    setCachedResponse_History(d->mod.history, resp);
+    delete_GmResponse(resp);
+    prefetchLinks_DocumentWidget_(d);
+    return iTrue;
+}
+
+static iBool updateFromDiskCache_DocumentWidget_(iDocumentWidget *d, float normScrollY) {
+    iGmResponse *resp = load_DiskCache(d->mod.url);
+    if (!resp) {
+        return iFalse;
+    }
+    updateFromCachedResponse_DocumentWidget_(d, normScrollY, resp);
+    setCachedResponse_History(d->mod.history, resp);
+    delete_GmResponse(resp);
+    return iTrue;
+}
+
+static void clearRetained_DocumentWidget_(iDocumentWidget *d) {
+    iForEach(PtrArray, i, &d->retained) {
+        delete_RetainedDocument(i.ptr);
+    }
+    clear_PtrArray(&d->retained);
+}
+
+static void forgetRuns_DocumentWidget_(iDocumentWidget *d) {
+    /* These point into the layout of the document being replaced. */
+    clear_PtrArray(&d->visibleLinks);
+    clear_PtrArray(&d->visibleWideRuns);
+    clear_PtrArray(&d->visiblePlayers);
+    clear_PtrSet(d->invalidRuns);
+    d->grabbedPlayer   = NULL;
+    d->hoverLink       = NULL;
+    d->contextLink     = NULL;
+    d->firstVisibleRun = NULL;
+    d->lastVisibleRun  = NULL;
+    d->foundMark       = iNullRange;
+    d->selectMark      = iNullRange;
+}
+
+static void retainDocument_DocumentWidget_(iDocumentWidget *d) {
+    /* Only complete pages that are in the history cache are worth keeping. Audio would keep
+       playing in the background. */
     const iRecentUrl *recent = findUrl_History(d->mod.history, d->mod.url);
-    if (recent && recent->cachedResponse) {
-        const iGmResponse *resp = recent->cachedResponse;
-        clear_ObjectList(d->media);
-        reset_GmDocument(d->doc);
-        d->state = fetching_RequestState;
-        d->initNormScrollY = recent->normScrollY;
-        resetWideRuns_DocumentWidget_(d);
-        /* Use the cached response data. */
-        updateTrust_DocumentWidget_(d, resp);
-        d->sourceTime = resp->when;
-        updateTimestampBuf_DocumentWidget_(d);
-        set_Block(&d->sourceContent, &resp->body);
-        updateDocument_DocumentWidget_(d, resp, iTrue);
-        init_Anim(&d->scrollY, d->initNormScrollY * size_GmDocument(d->doc).y);
-        d->state = ready_RequestState;
-        updateSideOpacity_DocumentWidget_(d, iFalse);
-        updateSideIconBuf_DocumentWidget_(d);
-        updateOutline_DocumentWidget_(d);
-        updateVisible_DocumentWidget_(d);
-        postCommandf_App("document.changed doc:%p url:%s", d, cstr_String(d->mod.url));
+    if (d->state != ready_RequestState || d->request || !recent ||
+        !hasCachedResponse_RecentUrl(recent) ||
+        numAudio_Media(media_GmDocument(d->doc)) > 0) {
+        return;
+    }
+    iRetainedDocument *ret = new_RetainedDocument();
+    set_String(&ret->url, d->mod.url);
+    ret->doc         = ref_Object(d->doc); /* stays visible until new content arrives */
+    ret->docWidth    = size_GmDocument(d->doc).x;
+    ret->scrollY     = value_Anim(&d->scrollY);
+    ret->normScrollY = normScrollPos_DocumentWidget_(d);
+    set_String(&ret->sourceMime, &d->sourceMime);
+    set_String(&ret->sourceMeta, &d->sourceMeta);
+    set_Block(&ret->sourceContent, &d->sourceContent);
+    ret->sourceTime  = d->sourceTime;
+    ret->certFlags   = d->certFlags;
+    set_Block(&ret->certFingerprint, d->certFingerprint);
+    ret->certExpiry  = d->certExpiry;
+    set_String(&ret->certSubject, d->certSubject);
+    /* Replace any older copy of the same page. */
+    for (size_t i = 0; i < size_PtrArray(&d->retained); i++) {
+        iRetainedDocument *old = at_PtrArray(&d->retained, i);
+        if (equal_String(&old->url, &ret->url)) {
+            delete_RetainedDocument(old);
+            remove_Array(&d->retained, i);
+            break;
+        }
+    }
+    pushBack_PtrArray(&d->retained, ret);
+    if (size_PtrArray(&d->retained) > maxRetained_DocumentWidget_) {
+        delete_RetainedDocument(at_PtrArray(&d->retained, 0));
+        remove_Array(&d->retained, 0);
+    }
+    /* Pending media requests and automatic image loads belong to the retained document. */
+    clear_ObjectList(d->media);
+    clear_Array(&d->imageFetches);
+}
+
+static void detachRetained_DocumentWidget_(iDocumentWidget *d) {
+    /* The previous page is kept visible while the new one is being fetched. New content
+       must not be placed in a document that is also retained. */
+    iConstForEach(PtrArray, i, &d->retained) {
+        const iRetainedDocument *ret = i.ptr;
+        if (ret->doc == d->doc) {
+            forgetRuns_DocumentWidget_(d);
+            iRelease(d->doc);
+            d->doc = new_GmDocument();
+            break;
+        }
+    }
+}
+
+static iBool updateFromRetained_DocumentWidget_(iDocumentWidget *d) {
+    iRetainedDocument *ret = NULL;
+    for (size_t i = 0; i < size_PtrArray(&d->retained); i++) {
+        iRetainedDocument *item = at_PtrArray(&d->retained, i);
+        if (equal_String(&item->url, d->mod.url)) {
+            take_PtrArray(&d->retained, i, (void **) &ret);
+            break;
+        }
+    }
+    if (!ret) {
+        return iFalse;
+    }
+    iReleasePtr(&d->request);
+    clear_ObjectList(d->media);
+    clear_Array(&d->imageFetches);
+    forgetRuns_DocumentWidget_(d);
+    /* Swap in the document as it was laid out. */
+    iRelease(d->doc);
+    d->doc = ret->doc;
+    ret->doc = NULL;
+    set_String(&d->sourceMime, &ret->sourceMime);
+    set_String(&d->sourceMeta, &ret->sourceMeta);
+    set_Block(&d->sourceContent, &ret->sourceContent);
+    d->sourceTime = ret->sourceTime;
+    d->certFlags  = ret->certFlags;
+    set_Block(d->certFingerprint, &ret->certFingerprint);
+    d->certExpiry = ret->certExpiry;
+    set_String(d->certSubject, &ret->certSubject);
+    /* Images that finished decoding while the document was retained still need textures. */
+    updateDecoded_Media(media_GmDocument(d->doc));
+    d->state = ready_RequestState;
+    d->flags &= ~showLinkNumbers_DocumentWidgetFlag;
+    iChangeFlags(d->flags,
+                 savedCopy_DocumentWidgetFlag,
+                 bannerType_GmDocument(d->doc) == savedCopy_GmDocumentBanner);
+    updateTrust_DocumentWidget_(d, NULL); /* banner affects the layout */
+    resetWideRuns_DocumentWidget_(d);
+    const int docWidth = documentWidth_DocumentWidget_(d);
+    if (ret->docWidth == docWidth) {
+        init_Anim(&d->scrollY, ret->scrollY);
+    }
+    else {
+        /* The window has been resized in the meantime. */
+        setWidth_GmDocument(d->doc, docWidth);
+        init_Anim(&d->scrollY, ret->normScrollY * size_GmDocument(d->doc).y);
+    }
+    delete_RetainedDocument(ret);
+    if (document_App() == d) {
+        updateTheme_DocumentWidget_(d);
+    }
+    updateTimestampBuf_DocumentWidget_(d);
+    updateWindowTitle_DocumentWidget_(d);
+    updateSideOpacity_DocumentWidget_(d, iFalse);
+    updateSideIconBuf_DocumentWidget_(d);
+    updateOutline_DocumentWidget_(d);
+    updateVisible_DocumentWidget_(d);
+    invalidate_DocumentWidget_(d);
+    refresh_Widget(as_Widget(d));
+    postCommandf_App("document.changed doc:%p url:%s", d, cstr_String(d->mod.url));
+    return iTrue;
+}
+
+static void wake_DocumentWidget_(iDocumentWidget *d) {
+    /* Rebuild the document from the compressed source. */
+    iGmResponse *resp = new_GmResponse();
+    resp->statusCode = success_GmStatusCode;
+    set_String(&resp->meta, &d->sourceMeta);
+#if defined (iHaveZlib)
+    iBlock *body = decompress_Block(&d->sourceContent);
+    set_Block(&resp->body, body);
+    delete_Block(body);
+#else
+    set_Block(&resp->body, &d->sourceContent);
+#endif
+    resp->certFlags = d->certFlags;
+    set_Block(&resp->certFingerprint, d->certFingerprint);
+    resp->certValidUntil = d->certExpiry;
+    set_String(&resp->certSubject, d->certSubject);
+    resp->when = d->sourceTime;
+    d->flags &= ~hibernated_DocumentWidgetFlag;
+    updateFromCachedResponse_DocumentWidget_(d, d->initNormScrollY, resp);
+    delete_GmResponse(resp);
+}
+
+static iBool updateFromHistory_DocumentWidget_(iDocumentWidget *d) {
+    const iRecentUrl * recent = findUrl_History(d->mod.history, d->mod.url);
+    iGmResponse *      cached = recent ? cachedResponse_RecentUrl(recent) : NULL;
+    if (cached) {
+        updateFromCachedResponse_DocumentWidget_(d, recent->normScrollY, cached);
+        delete_GmResponse(cached);
+        return iTrue;
+    }
+    else if (recent && updateFromDiskCache_DocumentWidget_(d, recent->normScrollY)) {
         return iTrue;
     }
     else if (!isEmpty_String(d->mod.url)) {
@@ -1025,6 +1409,19 @@ static iBool updateFromHistory_DocumentWidget_(iDocumentWidget *d) {
     return iFalse;
 }
 
+static void restore_DocumentWidget_(iDocumentWidget *d) {
+    if (d->flags & pendingRestore_DocumentWidgetFlag) {
+        d->flags &= ~pendingRestore_DocumentWidgetFlag;
+        clear_String(d->placeholderTitle);
+        if (d->flags & hibernated_DocumentWidgetFlag) {
+            wake_DocumentWidget_(d);
+        }
+        else {
+            updateFromHistory_DocumentWidget_(d);
+        }
+    }
+}
+
 static void refreshWhileScrolling_DocumentWidget_(iAny *ptr) {
     iDocumentWidget *d = ptr;
     updateVisible_DocumentWidget_(d);
@@ -1157,6 +1554,10 @@ static void checkResponse_DocumentWidget_(iDocumentWidget *d) {
     iGmResponse *resp = lockResponse_GmRequest(d->request);
     if (d->state == fetching_RequestState) {
         d->state = receivedPartialResponse_RequestState;
+        if (category_GmStatusCode(statusCode) != categoryInput_GmStatusCode &&
+            category_GmStatusCode(statusCode) != categoryRedirect_GmStatusCode) {
+            detachRetained_DocumentWidget_(d); /* the previous page gets replaced */
+        }
         updateTrust_DocumentWidget_(d, resp);
         init_Anim(&d->sideOpacity, 0);
         switch (category_GmStatusCode(statusCode)) {
@@ -1320,18 +1721,23 @@ static iBool handleMediaCommand_DocumentWidget_(iDocumentWidget *d, const char *
         const enum iGmStatusCode code = status_GmRequest(req->req);
         if (isSuccess_GmStatusCode(code)) {
             iGmResponse *resp = lockResponse_GmRequest(req->req);
-            if (startsWith_String(&resp->meta, "audio/")) {
+            const iBool isAudio = startsWith_String(&resp->meta, "audio/");
+            if (isAudio || startsWith_String(&resp->meta, "image/")) {
                 /* TODO: Use a helper? This is same as below except for the partialData flag. */
-                if (setData_Media(media_GmDocument(d->doc),
-                                  req->linkId,
-                                  &resp->meta,
-                                  &resp->body,
-                                  partialData_MediaFlag | allowHide_MediaFlag)) {
+                const iBool isNew = setData_Media(media_GmDocument(d->doc),
+                                                  req->linkId,
+                                                  &resp->meta,
+                                                  &resp->body,
+                                                  partialData_MediaFlag | allowHide_MediaFlag);
+                if (isNew) {
                     redoLayout_GmDocument(d->doc);
                 }
-                updateVisible_DocumentWidget_(d);
-                invalidate_DocumentWidget_(d);
-                refresh_Widget(as_Widget(d));
+                /* Image previews get redrawn along with the link's progress. */
+                if (isAudio || isNew) {
+                    updateVisible_DocumentWidget_(d);
+                    invalidate_DocumentWidget_(d);
+                    refresh_Widget(as_Widget(d));
+                }
             }
             unlockResponse_GmRequest(req->req);
         }
@@ -1358,9 +1764,14 @@ static iBool handleMediaCommand_DocumentWidget_(iDocumentWidget *d, const char *
             }
         }
         else {
-            const iGmError *err = get_GmError(code);
-            makeMessage_Widget(format_CStr(uiTextCaution_ColorEscape "%s", err->title), err->info);
+            /* Failures of automatic loading are not reported. */
+            if (!findImageFetch_DocumentWidget_(d, req->linkId)) {
+                const iGmError *err = get_GmError(code);
+                makeMessage_Widget(format_CStr(uiTextCaution_ColorEscape "%s", err->title),
+                                   err->info);
+            }
             removeMediaRequest_DocumentWidget_(d, req->linkId);
+            updateImageFetches_DocumentWidget_(d);
         }
         return iTrue;
     }
@@ -1396,6 +1807,98 @@ static iBool fetchNextUnfetchedImage_DocumentWidget_(iDocumentWidget *d) {
     return iFalse;
 }
 
+static iImageFetch *findImageFetch_DocumentWidget_(iDocumentWidget *d, iGmLinkId linkId) {
+    iForEach(Array, i, &d->imageFetches) {
+        iImageFetch *fetch = i.value;
+        if (fetch->linkId == linkId) {
+            return fetch;
+        }
+    }
+    return NULL;
+}
+
+iDeclareType(ImageFetchCandidates)
+
+struct Impl_ImageFetchCandidates {
+    iDocumentWidget *doc;
+    iArray           candidates; /* iImageFetch */
+};
+
+static void addImageFetchCandidate_(void *context, const iGmRun *run) {
+    iImageFetchCandidates *d = context;
+    if (!run->linkId || run->imageId || run->flags & decoration_GmRunFlag) {
+        return;
+    }
+    const iGmDocument *doc       = d->doc->doc;
+    const int          linkFlags = linkFlags_GmDocument(doc, run->linkId);
+    if (!isMediaLink_GmDocument(doc, run->linkId) || ~linkFlags & imageFileExtension_GmLinkFlag ||
+        linkFlags & (content_GmLinkFlag | permanent_GmLinkFlag) ||
+        findMediaRequest_DocumentWidget_(d->doc, run->linkId) ||
+        findImageFetch_DocumentWidget_(d->doc, run->linkId)) {
+        return;
+    }
+    iConstForEach(Array, i, &d->candidates) {
+        if (((const iImageFetch *) i.value)->linkId == run->linkId) {
+            return; /* link wraps to multiple lines */
+        }
+    }
+    pushBack_Array(&d->candidates,
+                   &(iImageFetch){ .linkId = run->linkId, .docY = top_Rect(run->visBounds) });
+}
+
+static void updateImageFetches_DocumentWidget_(iDocumentWidget *d) {
+    const int maxFetches = prefs_App()->maxImageFetches;
+    if (maxFetches <= 0 || d->state != ready_RequestState || document_App() != d) {
+        return;
+    }
+    const iRangei visRange = visibleRange_DocumentWidget_(d);
+    const int     height   = size_Range(&visRange);
+    const int     midY     = (visRange.start + visRange.end) / 2;
+    /* Cancel the images that have been scrolled far away. */
+    int numActive = 0;
+    for (size_t i = 0; i < size_Array(&d->imageFetches); ) {
+        const iImageFetch *fetch = constAt_Array(&d->imageFetches, i);
+        const iMediaRequest *req = findMediaRequest_DocumentWidget_(d, fetch->linkId);
+        if (req && !isFinished_GmRequest(req->req)) {
+            if (iAbs(fetch->docY - midY) > 3 * height) {
+                removeMediaRequest_DocumentWidget_(d, fetch->linkId);
+                remove_Array(&d->imageFetches, i);
+                continue;
+            }
+            numActive++;
+        }
+        i++;
+    }
+    if (numActive >= maxFetches) {
+        return;
+    }
+    /* Start loading the unfetched images closest to the viewport. Images within one screen
+       above and below the visible area are also considered. */
+    iImageFetchCandidates params = { .doc = d };
+    init_Array(&params.candidates, sizeof(iImageFetch));
+    render_GmDocument(d->doc,
+                      (iRangei){ visRange.start - height, visRange.end + height },
+                      addImageFetchCandidate_,
+                      &params);
+    while (numActive < maxFetches && !isEmpty_Array(&params.candidates)) {
+        size_t nearest = 0;
+        iConstForEach(Array, i, &params.candidates) {
+            const iImageFetch *fetch = i.value;
+            if (iAbs(fetch->docY - midY) <
+                iAbs(((const iImageFetch *) constAt_Array(&params.candidates, nearest))->docY - midY)) {
+                nearest = index_ArrayConstIterator(&i);
+            }
+        }
+        iImageFetch fetch = *(const iImageFetch *) constAt_Array(&params.candidates, nearest);
+        remove_Array(&params.candidates, nearest);
+        if (requestMedia_DocumentWidget_(d, fetch.linkId)) {
+            pushBack_Array(&d->imageFetches, &fetch);
+            numActive++;
+        }
+    }
+    deinit_Array(&params.candidates);
+}
+
 static void saveToDownloads_(const iString *url, const iString *mime, const iBlock *content) {
     /* Figure out a file name from the URL. */
     iUrl parts;
@@ -1471,6 +1974,9 @@ static void saveToDownloads_(const iString *url, const iString *mime, const iBlo
 static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd) {
     iWidget *w = as_Widget(d);
     if (equal_Command(cmd, "window.resized") || equal_Command(cmd, "font.changed")) {
+        if (equal_Command(cmd, "font.changed")) {
+            clearRetained_DocumentWidget_(d); /* layouts are out of date */
+        }
         const iGmRun *mid = middleRun_DocumentWidget_(d);
         const char *midLoc = (mid ? mid->text.start : NULL);
         /* Alt/Option key may be involved in window size changes. */
@@ -1482,6 +1988,10 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
             if (mid) {
                 scrollTo_DocumentWidget_(d, mid_Rect(mid->bounds).y, iTrue);
             }
+            else if (isLarge_GmDocument(d->doc)) {
+                const iRangei span = locLineSpan_GmDocument(d->doc, midLoc);
+                scrollTo_DocumentWidget_(d, (span.start + span.end) / 2, iTrue);
+            }
         }
         updateSideIconBuf_DocumentWidget_(d);
         updateOutline_DocumentWidget_(d);
@@ -1510,17 +2020,23 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
         refresh_Widget(w);
     }
     else if (equal_Command(cmd, "document.layout.changed") && document_App() == d) {
+        clearRetained_DocumentWidget_(d);
         updateSize_DocumentWidget(d);
     }
     else if (equal_Command(cmd, "tabs.changed")) {
         iChangeFlags(d->flags, showLinkNumbers_DocumentWidgetFlag, iFalse);
         if (cmp_String(id_Widget(w), suffixPtr_Command(cmd, "id")) == 0) {
+            iZap(d->hiddenSince);
+            restore_DocumentWidget_(d);
             /* Set palette for our document. */
             updateTheme_DocumentWidget_(d);
             updateTrust_DocumentWidget_(d, NULL);
             updateSize_DocumentWidget(d);
             updateFetchProgress_DocumentWidget_(d);
         }
+        else if (!isValid_Time(&d->hiddenSince)) {
+            initCurrent_Time(&d->hiddenSince); /* another tab was selected */
+        }
         init_Anim(&d->sideOpacity, 0);
         updateSideOpacity_DocumentWidget_(d, iFalse);
         updateOutlineOpacity_DocumentWidget_(d);
@@ -1628,8 +2144,8 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
     }
     else if (equalWidget_Command(cmd, w, "document.request.updated") &&
              d->request && pointerLabel_Command(cmd, "request") == d->request) {
-        set_Block(&d->sourceContent, &lockResponse_GmRequest(d->request)->body);
-        unlockResponse_GmRequest(d->request);
+        /* Note: `sourceContent` is set when finished. Holding on to the body while it still
+           grows would force it to be copied on every update. */
         if (document_App() == d) {
             updateFetchProgress_DocumentWidget_(d);
         }
@@ -1639,6 +2155,7 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
     }
     else if (equalWidget_Command(cmd, w, "document.request.finished") &&
              pointerLabel_Command(cmd, "request") == d->request) {
+        const enum iGmStatusCode statusCode = status_GmRequest(d->request);
         set_Block(&d->sourceContent, body_GmRequest(d->request));
         updateFetchProgress_DocumentWidget_(d);
         checkResponse_DocumentWidget_(d);
@@ -1647,15 +2164,28 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
         /* The response may be cached. */ {
             if (!equal_Rangecc(urlScheme_String(d->mod.url), "about") &&
                 startsWithCase_String(meta_GmRequest(d->request), "text/")) {
-                setCachedResponse_History(d->mod.history, lockResponse_GmRequest(d->request));
+                const iGmResponse *resp = lockResponse_GmRequest(d->request);
+                setCachedResponse_History(d->mod.history, resp);
+                if (!equalCase_Rangecc(urlScheme_String(d->mod.url), "file")) {
+                    store_DiskCache(d->mod.url, resp);
+                }
                 unlockResponse_GmRequest(d->request);
             }
         }
         iReleasePtr(&d->request);
+        if (statusCode == tlsFailure_GmStatusCode) {
+            /* Couldn't connect, so show the copy saved earlier instead. */
+            d->flags |= savedCopy_DocumentWidgetFlag;
+            if (updateFromDiskCache_DocumentWidget_(d, 0.0f)) {
+                return iFalse;
+            }
+            d->flags &= ~savedCopy_DocumentWidgetFlag;
+        }
         updateVisible_DocumentWidget_(d);
         updateSideIconBuf_DocumentWidget_(d);
         updateOutline_DocumentWidget_(d);
         postCommandf_App("document.changed url:%s", cstr_String(d->mod.url));
+        prefetchLinks_DocumentWidget_(d);
         /* Check for a pending goto. */
         if (!isEmpty_String(&d->pendingGotoHeading)) {
             scrollToHeading_DocumentWidget_(d, cstr_String(&d->pendingGotoHeading));
@@ -1666,6 +2196,19 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
     else if (equal_Command(cmd, "media.updated") || equal_Command(cmd, "media.finished")) {
         return handleMediaCommand_DocumentWidget_(d, cmd);
     }
+    else if (equal_Command(cmd, "media.decoded")) {
+        /* Decoding may have finished for an image in any of the documents. */
+        if (document_App() == d) {
+            /* Keep the visible textures from being evicted to make room for new ones. */
+            render_GmDocument(
+                d->doc, visibleRange_DocumentWidget_(d), markImageUsed_DocumentWidget_, d);
+        }
+        if (updateDecoded_Media(media_GmDocument(d->doc))) {
+            invalidate_DocumentWidget_(d);
+            refresh_Widget(w);
+        }
+        return iFalse;
+    }
     else if (equal_Command(cmd, "media.player.started")) {
         /* When one media player starts, pause the others that may be playing. */
         const iPlayer *startedPlr = pointerLabel_Command(cmd, "player");
@@ -1856,6 +2399,11 @@ static iBool handleCommand_DocumentWidget_(iDocumentWidget *d, const char *cmd)
                 if ((found = findRunAtLoc_GmDocument(d->doc, d->foundMark.start)) != NULL) {
                     scrollTo_DocumentWidget_(d, mid_Rect(found->bounds).y, iTrue);
                 }
+                else if (isLarge_GmDocument(d->doc)) {
+                    /* Not laid out yet. */
+                    const iRangei span = locLineSpan_GmDocument(d->doc, d->foundMark.start);
+                    scrollTo_DocumentWidget_(d, (span.start + span.end) / 2, iTrue);
+                }
             }
         }
         invalidateWideRunsWithNonzeroOffset_DocumentWidget_(d); /* markers don't support offsets */
@@ -2615,6 +3163,26 @@ static void drawBannerRun_DrawContext_(iDrawContext *d, const iGmRun *run, iInt2
                            fg,
                            range_String(&str));
     }
+    else if (bannerType_GmDocument(doc) == savedCopy_GmDocumentBanner) {
+        const int domainHeight = lineHeight_Text(banner_FontId) * 2;
+        const int noteHeight   = run->visBounds.size.y - domainHeight;
+        const iRect bgRect =
+            init_Rect(0, visPos.y + domainHeight, d->widgetBounds.size.x, noteHeight);
+        fillRect_Paint(&d->paint, bgRect, tmBannerBackground_ColorId);
+        drawHLine_Paint(&d->paint, topLeft_Rect(bgRect), width_Rect(bgRect), tmBannerTitle_ColorId);
+        drawHLine_Paint(
+            &d->paint, bottomLeft_Rect(bgRect), width_Rect(bgRect), tmBannerTitle_ColorId);
+        iDate saved;
+        init_Date(&saved, &d->widget->sourceTime);
+        format_String(&str,
+                      "\u26a0 Couldn't connect. This is a copy saved on %s.",
+                      cstrCollect_String(format_Date(&saved, "%Y-%m-%d %H:%M")));
+        drawString_Text(uiLabel_FontId,
+                        init_I2(visPos.x, top_Rect(bgRect) +
+                                              (noteHeight - lineHeight_Text(uiLabel_FontId)) / 2),
+                        tmBannerTitle_ColorId,
+                        &str);
+    }
     deinit_String(&str);
 }
 
@@ -2622,13 +3190,20 @@ static void drawRun_DrawContext_(void *context, const iGmRun *run) {
     iDrawContext *d      = context;
     const iInt2   origin = d->viewPos;
     if (run->imageId) {
-        SDL_Texture *tex = imageTexture_Media(media_GmDocument(d->widget->doc), run->imageId);
+        SDL_Texture *tex = imageTexture_Media(
+            media_GmDocument(d->widget->doc), run->imageId, width_Rect(run->visBounds));
         if (tex) {
             const iRect dst = moved_Rect(run->visBounds, origin);
             fillRect_Paint(&d->paint, dst, tmBackground_ColorId); /* in case the image has alpha */
             SDL_RenderCopy(d->paint.dst->render, tex, NULL,
                            &(SDL_Rect){ dst.pos.x, dst.pos.y, dst.size.x, dst.size.y });
         }
+        else {
+            /* Placeholder while the image is being decoded. */
+            const iRect dst = moved_Rect(run->visBounds, origin);
+            fillRect_Paint(&d->paint, dst, tmBackground_ColorId);
+            drawRect_Paint(&d->paint, dst, tmQuoteIcon_ColorId);
+        }
         return;
     }
     else if (run->audioId) {
@@ -3122,6 +3697,9 @@ const iString *bookmarkTitle_DocumentWidget(const iDocumentWidget *d) {
     if (!isEmpty_String(title_GmDocument(d->doc))) {
         pushBack_StringArray(title, title_GmDocument(d->doc));
     }
+    else if (d->flags & pendingRestore_DocumentWidgetFlag && !isEmpty_String(d->placeholderTitle)) {
+        pushBack_StringArray(title, d->placeholderTitle);
+    }
     if (!isEmpty_String(d->titleUser)) {
         pushBack_StringArray(title, d->titleUser);
     }
@@ -3140,22 +3718,46 @@ const iString *bookmarkTitle_DocumentWidget(const iDocumentWidget *d) {
 
 void serializeState_DocumentWidget(const iDocumentWidget *d, iStream *outs) {
     serialize_PersistentDocumentState(&d->mod, outs);
+    serialize_String(d->flags & pendingRestore_DocumentWidgetFlag ? d->placeholderTitle
+                                                                  : title_GmDocument(d->doc),
+                     outs);
 }
 
 void deserializeState_DocumentWidget(iDocumentWidget *d, iStream *ins) {
     deserialize_PersistentDocumentState(&d->mod, ins);
+    if (version_Stream(ins) >= addedTabTitles_FileVersion) {
+        deserialize_String(d->placeholderTitle, ins);
+    }
     parseUser_DocumentWidget_(d);
-    updateFromHistory_DocumentWidget_(d);
+    /* The document is loaded when the tab is first shown. */
+    d->flags |= pendingRestore_DocumentWidgetFlag;
+    updateWindowTitle_DocumentWidget_(d);
 }
 
 void setUrlFromCache_DocumentWidget(iDocumentWidget *d, const iString *url, iBool isFromCache) {
     d->flags &= ~showLinkNumbers_DocumentWidgetFlag;
+    if (d->flags & pendingRestore_DocumentWidgetFlag) {
+        /* Nothing has been loaded yet, so even the same URL needs updating. */
+        if (d->flags & hibernated_DocumentWidgetFlag) {
+            clear_Block(&d->sourceContent);
+        }
+        d->flags &= ~(pendingRestore_DocumentWidgetFlag | hibernated_DocumentWidgetFlag);
+        clear_String(d->placeholderTitle);
+        clear_String(d->mod.url);
+    }
     if (cmpStringSc_String(d->mod.url, url, &iCaseInsensitive)) {
+        retainDocument_DocumentWidget_(d);
+        d->flags &= ~savedCopy_DocumentWidgetFlag;
         set_String(d->mod.url, url);
         /* See if there a username in the URL. */
         parseUser_DocumentWidget_(d);
+        if (isFromCache && updateFromRetained_DocumentWidget_(d)) {
+            return;
+        }
         if (!isFromCache || !updateFromHistory_DocumentWidget_(d)) {
-            fetch_DocumentWidget_(d);
+            if (!updateFromPrefetch_DocumentWidget_(d)) {
+                fetch_DocumentWidget_(d);
+            }
         }
     }
     else {
@@ -3163,6 +3765,56 @@ void setUrlFromCache_DocumentWidget(iDocumentWidget *d, const iString *url, iBoo
     }
 }
 
+size_t memorySize_DocumentWidget(const iDocumentWidget *d) {
+    size_t size = size_Block(&d->sourceContent) + memorySize_GmDocument(d->doc);
+    iConstForEach(PtrArray, i, &d->retained) {
+        const iRetainedDocument *ret = i.ptr;
+        size += size_Block(&ret->sourceContent);
+        if (ret->doc != d->doc) {
+            size += memorySize_GmDocument(ret->doc);
+        }
+    }
+    return size;
+}
+
+double inactiveSeconds_DocumentWidget(const iDocumentWidget *d) {
+    return isValid_Time(&d->hiddenSince) ? elapsedSeconds_Time(&d->hiddenSince) : 0.0;
+}
+
+iBool isHibernating_DocumentWidget(const iDocumentWidget *d) {
+    return (d->flags & pendingRestore_DocumentWidgetFlag) != 0;
+}
+
+size_t hibernate_DocumentWidget(iDocumentWidget *d) {
+    /* Pages with audio would stop playing, and requests in progress need the document. */
+    if (d->flags & pendingRestore_DocumentWidgetFlag || document_App() == d ||
+        d->state != ready_RequestState || d->request || isEmpty_String(&d->sourceMeta) ||
+        numAudio_Media(media_GmDocument(d->doc)) > 0) {
+        return 0;
+    }
+    const size_t oldSize = memorySize_DocumentWidget(d);
+    set_String(d->placeholderTitle, title_GmDocument(d->doc));
+    d->initNormScrollY = normScrollPos_DocumentWidget_(d);
+    clearRetained_DocumentWidget_(d);
+    clear_ObjectList(d->media);
+    clear_Array(&d->imageFetches);
+    forgetRuns_DocumentWidget_(d);
+    iRelease(d->doc);
+    d->doc = new_GmDocument();
+    clear_Array(&d->outline);
+    updateSideIconBuf_DocumentWidget_(d); /* releases the texture */
+#if defined (iHaveZlib)
+    iBlock *zipped = compress_Block(&d->sourceContent);
+    set_Block(&d->sourceContent, zipped);
+    delete_Block(zipped);
+#endif
+    d->state = blank_RequestState;
+    d->flags |= pendingRestore_DocumentWidgetFlag | hibernated_DocumentWidgetFlag;
+    updateWindowTitle_DocumentWidget_(d);
+    const size_t newSize = memorySize_DocumentWidget(d);
+    return oldSize > newSize ? oldSize - newSize : 0;
+}
+
 iDocumentWidget *duplicate_DocumentWidget(const iDocumentWidget *orig) {
     iDocumentWidget *d = new_DocumentWidget();
     delete_History(d->mod.history);
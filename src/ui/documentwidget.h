@@ -32,7 +32,7 @@ iDeclareWidgetClass(DocumentWidget)
 iDeclareObjectConstruction(DocumentWidget)
 
 void    serializeState_DocumentWidget   (const iDocumentWidget *, iStream *outs);
-void    deserializeState_DocumentWidget (iDocumentWidget *, iStream *ins);
+void    deserializeState_DocumentWidget (iDocumentWidget *, iStream *ins); /* loaded when first shown */
 
 iDocumentWidget *   duplicate_DocumentWidget        (const iDocumentWidget *);
 iHistory *          history_DocumentWidget          (iDocumentWidget *);
@@ -49,3 +49,8 @@ void    setInitialScroll_DocumentWidget (iDocumentWidget *, float normScrollY);
 void    setRedirectCount_DocumentWidget (iDocumentWidget *, int count);
 
 void    updateSize_DocumentWidget       (iDocumentWidget *);
+
+size_t  memorySize_DocumentWidget       (const iDocumentWidget *); /* approximate; excludes history */
+double  inactiveSeconds_DocumentWidget  (const iDocumentWidget *); /* zero while shown */
+iBool   isHibernating_DocumentWidget    (const iDocumentWidget *);
+size_t  hibernate_DocumentWidget        (iDocumentWidget *); /* returns bytes released */
@@ -25,6 +25,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "app.h"
 #include "bookmarks.h"
 #include "command.h"
+#include "contentindex.h"
+#include "diskcache.h"
 #include "documentwidget.h"
 #include "gmcerts.h"
 #include "gmutil.h"
@@ -38,11 +40,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <the_Foundation/mutex.h>
 #include <the_Foundation/thread.h>
 #include <the_Foundation/regexp.h>
+#include <the_Foundation/stringset.h>
 
 iDeclareType(LookupJob)
 
+static const size_t maxDiskCacheSearch_LookupJob_ = 30; /* pages loaded per lookup */
+
 struct Impl_LookupJob {
     iRegExp *term;
+    iString words; /* as entered */
     iTime now;
     iObjectList *docs;
     iPtrArray results;
@@ -50,6 +56,7 @@ struct Impl_LookupJob {
 
 static void init_LookupJob(iLookupJob *d) {
     d->term = NULL;
+    init_String(&d->words);
     initCurrent_Time(&d->now);
     d->docs = NULL;
     init_PtrArray(&d->results);
@@ -61,6 +68,7 @@ static void deinit_LookupJob(iLookupJob *d) {
     }
     deinit_PtrArray(&d->results);
     iRelease(d->docs);
+    deinit_String(&d->words);
     iRelease(d->term);
 }
 
@@ -175,10 +183,6 @@ static float visitedRelevance_LookupJob_(const iLookupJob *d, const iVisitedUrl
     return iMax(h, p) / (age + 1); /* extra weight for recency */
 }
 
-static iBool matchBookmark_LookupJob_(void *context, const iBookmark *bm) {
-    return bookmarkRelevance_LookupJob_(context, bm) > 0;
-}
-
 static iBool matchIdentity_LookupJob_(void *context, const iGmIdentity *identity) {
     return identityRelevance_LookupJob_(context, identity) > 0;
 }
@@ -186,11 +190,15 @@ static iBool matchIdentity_LookupJob_(void *context, const iGmIdentity *identity
 static void searchBookmarks_LookupJob_(iLookupJob *d) {
     /* Note: Called in a background thread. */
     /* TODO: Thread safety! What if a bookmark gets deleted while its being accessed here? */
-    iConstForEach(PtrArray, i, list_Bookmarks(bookmarks_App(), NULL, matchBookmark_LookupJob_, d)) {
-        const iBookmark *bm  = i.ptr;
-        iLookupResult *  res = new_LookupResult();
-        res->type            = bookmark_LookupResultType;
-        res->relevance       = bookmarkRelevance_LookupJob_(d, bm);
+    iConstForEach(PtrArray, i, list_Bookmarks(bookmarks_App(), NULL, NULL, NULL)) {
+        const iBookmark *bm        = i.ptr;
+        const float      relevance = bookmarkRelevance_LookupJob_(d, bm);
+        if (relevance <= 0) {
+            continue;
+        }
+        iLookupResult *res = new_LookupResult();
+        res->type          = bookmark_LookupResultType;
+        res->relevance     = relevance;
         appendChar_String(&res->label, bm->icon);
         appendChar_String(&res->label, ' ');
         append_String(&res->label, &bm->title);
@@ -220,28 +228,61 @@ static void searchVisited_LookupJob_(iLookupJob *d) {
     }
 }
 
+static void addContentResult_LookupJob_(iLookupJob *d, const char *match, float relevance) {
+    const size_t matchLen = argLabel_Command(match, "len");
+    iRangecc text;
+    text.start = strstr(match, " str:") + 5;
+    text.end = text.start + matchLen;
+    const char *url = strstr(text.end, " url:") + 5;
+    iLookupResult *res = new_LookupResult();
+    res->type = content_LookupResultType;
+    res->relevance = relevance;
+    setCStr_String(&res->label, "\"");
+    appendRange_String(&res->label, text);
+    appendCStr_String(&res->label, "\"");
+    setCStr_String(&res->url, url);
+    pushBack_PtrArray(&d->results, res);
+}
+
 static void searchHistory_LookupJob_(iLookupJob *d) {
     /* Note: Called in a background thread. */
+    iStringSet *found = new_StringSet();
     size_t index = 0;
     iForEach(ObjectList, i, d->docs) {
         iConstForEach(StringArray, j,
                       searchContents_History(history_DocumentWidget(i.object), d->term)) {
             const char *match = cstr_String(j.value);
-            const size_t matchLen = argLabel_Command(match, "len");
-            iRangecc text;
-            text.start = strstr(match, " str:") + 5;
-            text.end = text.start + matchLen;
-            const char *url = strstr(text.end, " url:") + 5;
-            iLookupResult *res = new_LookupResult();
-            res->type = content_LookupResultType;
-            res->relevance = ++index; /* most recent comes last */
-            setCStr_String(&res->label, "\"");
-            appendRange_String(&res->label, text);
-            appendCStr_String(&res->label, "\"");
-            setCStr_String(&res->url, url);
-            pushBack_PtrArray(&d->results, res);
+            insert_StringSet(found, collect_String(newCStr_String(strstr(match, " url:") + 5)));
+            addContentResult_LookupJob_(d, match, ++index); /* most recent comes last */
+        }
+    }
+    /* Pages from earlier sessions are in the disk cache, and the index picks which of them to
+       load. The history above was searched in full: the index is updated in the background
+       and may not cover the most recent pages yet. */
+    iStringArray *candidates = query_ContentIndex(&d->words);
+    if (candidates) {
+        size_t numLoaded = 0;
+        for (size_t k = size_StringArray(candidates); k-- > 0; ) { /* most recent first */
+            const iString *url = constAt_StringArray(candidates, k);
+            if (contains_StringSet(found, url)) {
+                continue;
+            }
+            if (++numLoaded > maxDiskCacheSearch_LookupJob_) {
+                break;
+            }
+            iGmResponse *resp = load_DiskCache(url);
+            if (resp) {
+                const iString *match = searchResponse_History(d->term, url, resp);
+                if (match) {
+                    insert_StringSet(found, url);
+                    addContentResult_LookupJob_(d, cstr_String(match), 0);
+                }
+                delete_GmResponse(resp);
+            }
         }
+        iRelease(candidates);
     }
+    iRelease(found);
 }
 
 static void searchIdentities_LookupJob_(iLookupJob *d) {
@@ -294,6 +335,7 @@ static iThreadResult worker_LookupWidget_(iThread *thread) {
             delete_String(pattern);
         }
         const size_t termLen = size_String(&d->pendingTerm);
+        set_String(&job->words, &d->pendingTerm);
         clear_String(&d->pendingTerm);
         job->docs = d->pendingDocs;
         d->pendingDocs = NULL;
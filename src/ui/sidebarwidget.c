@@ -196,8 +196,6 @@ static void updateItems_SidebarWidget_(iSidebarWidget *d) {
             break;
         }
         case bookmarks_SidebarMode: {
-            iRegExp *homeTag = iClob(new_RegExp("\\bhomepage\\b", caseSensitive_RegExpOption));
-            iRegExp *subTag  = iClob(new_RegExp("\\bsubscribed\\b", caseSensitive_RegExpOption));
             iConstForEach(PtrArray, i, list_Bookmarks(bookmarks_App(), cmpTitle_Bookmark_, NULL, NULL)) {
                 const iBookmark *bm = i.ptr;
                 iSidebarItem *item = new_SidebarItem();
@@ -206,13 +204,10 @@ static void updateItems_SidebarWidget_(iSidebarWidget *d) {
                 set_String(&item->url, &bm->url);
                 set_String(&item->label, &bm->title);
                 /* Icons for special tags. */ {
-                    iRegExpMatch m;
-                    init_RegExpMatch(&m);
-                    if (matchString_RegExp(subTag, &bm->tags, &m)) {
+                    if (hasTag_Bookmark(bm, "subscribed")) {
                         appendChar_String(&item->meta, 0x2605);
                     }
-                    init_RegExpMatch(&m);
-                    if (matchString_RegExp(homeTag, &bm->tags, &m)) {
+                    if (hasTag_Bookmark(bm, "homepage")) {
                         appendChar_String(&item->meta, 0x1f3e0);
                     }
                 }
@@ -595,6 +590,7 @@ iBool handleBookmarkEditorCommands_SidebarWidget_(iWidget *editor, const char *c
             set_String(&bm->title, title);
             set_String(&bm->url, url);
             set_String(&bm->tags, tags);
+            reindex_Bookmarks(bookmarks_App(), item->id);
             postCommand_App("bookmarks.changed");
         }
         setFlags_Widget(as_Widget(d), disabled_WidgetFlag, iFalse);
@@ -747,6 +743,7 @@ static iBool processEvent_SidebarWidget_(iSidebarWidget *d, const SDL_Event *ev)
                 else {
                     addTag_Bookmark(bm, tag);
                 }
+                reindex_Bookmarks(bookmarks_App(), item->id);
                 postCommand_App("bookmarks.changed");
             }
             return iTrue;
@@ -816,6 +813,7 @@ static iBool processEvent_SidebarWidget_(iSidebarWidget *d, const SDL_Event *ev)
                     if (isCommand_Widget(w, ev, "feed.entry.unsubscribe")) {
                         if (arg_Command(cmd)) {
                             removeTag_Bookmark(feedBookmark, "subscribed");
+                            reindex_Bookmarks(bookmarks_App(), id_Bookmark(feedBookmark));
                             removeEntries_Feeds(id_Bookmark(feedBookmark));
                             updateItems_SidebarWidget_(d);
                         }
@@ -368,7 +368,8 @@ iWidget *addAction_Widget(iWidget *parent, int key, int kmods, const char *comma
 
 static iBool isCommandIgnoredByMenus_(const char *cmd) {
     return equal_Command(cmd, "media.updated") || equal_Command(cmd, "media.player.update") ||
-           startsWith_CStr(cmd, "feeds.update.") ||
+           equal_Command(cmd, "media.decoded") || startsWith_CStr(cmd, "feeds.update.") ||
+           equal_Command(cmd, "app.autosave") || equal_Command(cmd, "app.hibernate") ||
            equal_Command(cmd, "document.request.updated") || equal_Command(cmd, "window.resized") ||
            (equal_Command(cmd, "mouse.clicked") && !arg_Command(cmd)); /* button released */
 }
@@ -891,7 +892,9 @@ void updateValueInput_Widget(iWidget *d, const char *title, const char *prompt)
 static iBool messageHandler_(iWidget *msg, const char *cmd) {
     /* Almost any command dismisses the sheet. */
     if (!(equal_Command(cmd, "media.updated") || equal_Command(cmd, "media.player.update") ||
-          equal_Command(cmd, "document.request.updated") || startsWith_CStr(cmd, "window."))) {
+          equal_Command(cmd, "media.decoded") || equal_Command(cmd, "document.request.updated") ||
+          equal_Command(cmd, "app.autosave") || equal_Command(cmd, "app.hibernate") ||
+          startsWith_CStr(cmd, "window."))) {
         destroy_Widget(msg);
     }
     return iFalse;
@@ -1037,6 +1040,8 @@ iWidget *makePreferences_Widget(void) {
         addChild_Widget(values, iClob(makeToggle_Widget("prefs.smoothscroll")));
         addChild_Widget(headings, iClob(makeHeading_Widget("Load image on scroll:")));
         addChild_Widget(values, iClob(makeToggle_Widget("prefs.imageloadscroll")));
+        addChild_Widget(headings, iClob(makeHeading_Widget("Auto-load images:")));
+        setId_Widget(addChild_Widget(values, iClob(new_InputWidget(4))), "prefs.imagefetches");
     }
     /* Window. */ {
         appendTwoColumnPage_(tabs, "Window", '2', &headings, &values);
@@ -1135,8 +1140,12 @@ iWidget *makePreferences_Widget(void) {
         addChild_Widget(headings, iClob(makeHeading_Widget("Big 1st paragaph:")));
         addChild_Widget(values, iClob(makeToggle_Widget("prefs.biglede")));
     }
-    /* Proxies. */ {
-        appendTwoColumnPage_(tabs, "Proxies", '5', &headings, &values);
+    /* Network. */ {
+        appendTwoColumnPage_(tabs, "Network", '5', &headings, &values);
+        addChild_Widget(headings, iClob(makeHeading_Widget("Prefetch links:")));
+        setId_Widget(addChild_Widget(values, iClob(new_InputWidget(4))), "prefs.prefetch.count");
+        addChild_Widget(headings, iClob(makeHeading_Widget("Prefetch pattern:")));
+        setId_Widget(addChild_Widget(values, iClob(new_InputWidget(0))), "prefs.prefetch.pattern");
         addChild_Widget(headings, iClob(makeHeading_Widget("Gemini proxy:")));
         setId_Widget(addChild_Widget(values, iClob(new_InputWidget(0))), "prefs.proxy.gemini");
         addChild_Widget(headings, iClob(makeHeading_Widget("Gopher proxy:")));
@@ -1154,6 +1163,7 @@ iWidget *makePreferences_Widget(void) {
     /* Set input field sizes. */ {
         expandInputFieldWidth_(findChild_Widget(tabs, "prefs.downloads"));
         expandInputFieldWidth_(findChild_Widget(tabs, "prefs.proxy.gemini"));
+        expandInputFieldWidth_(findChild_Widget(tabs, "prefs.prefetch.pattern"));
         expandInputFieldWidth_(findChild_Widget(tabs, "prefs.proxy.gopher"));
         expandInputFieldWidth_(findChild_Widget(tabs, "prefs.proxy.http"));
     }
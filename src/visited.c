@@ -22,12 +22,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "visited.h"
 #include "app.h"
+#include "defs.h"
 
 #include <the_Foundation/file.h>
+#include <the_Foundation/fileinfo.h>
 #include <the_Foundation/mutex.h>
 #include <the_Foundation/path.h>
 #include <the_Foundation/ptrarray.h>
-#include <the_Foundation/sortedarray.h>
+
+#include <stdio.h>
 
 const int maxAge_Visited = 2 * 3600 * 24 * 30; /* two months */
 
@@ -41,166 +44,480 @@ void deinit_VisitedUrl(iVisitedUrl *d) {
     deinit_String(&d->url);
 }
 
-static int cmpUrl_VisitedUrl_(const void *a, const void *b) {
-    return cmpString_String(&((const iVisitedUrl *) a)->url, &((const iVisitedUrl *) b)->url);
-}
-
 static int cmpNewer_VisitedUrl_(const void *insert, const void *existing) {
     return seconds_Time(&((const iVisitedUrl *) insert  )->when) >
            seconds_Time(&((const iVisitedUrl *) existing)->when);
 }
 
+uint32_t urlHash_Visited(iRangecc url) {
+    /* 32-bit FNV-1a. */
+    uint32_t hash = 0x811c9dc5;
+    for (const char *ch = url.start; ch != url.end; ch++) {
+        hash ^= (uint8_t) *ch;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static iBool equalUrl_VisitedUrl_(const iVisitedUrl *d, iRangecc url) {
+    return size_String(&d->url) == size_Range(&url) &&
+           !memcmp(cstr_String(&d->url), url.start, size_Range(&url));
+}
+
 /*----------------------------------------------------------------------------------------------*/
 
+/* visited.bin is an append-only log of visits and removals. Each save appends only the records
+   made since the previous save; the log is compacted (rewritten with just the live entries) when
+   it has grown much larger than the set of visited URLs. */
+
+static const char *fileName_Visited_    = "visited.bin";
+static const char *oldFileName_Visited_ = "visited.txt";
+static const char *magic_Visited_       = "lgV1";
+
+enum iVisitedRecordType {
+    visit_VisitedRecordType  = 1,
+    remove_VisitedRecordType = 2,
+};
+
+/* Record layout (little-endian):
+   u8 type, u16 flags, u64 seconds, u32 url size, url bytes */
+static const size_t recordHeaderSize_Visited_ = 1 + 2 + 8 + 4;
+
+/* Lookups are first checked against a Bloom filter that can be read without locking. Most
+   lookups are for links that have not been visited, and those are answered by the filter alone.
+   Bits are only set while holding the mutex; stale reads during a concurrent visit just give
+   the answer from before the visit. */
+
+enum {
+    numBloomBits_Visited_  = 1 << 19,
+    numBloomWords_Visited_ = numBloomBits_Visited_ / 32,
+};
+
+iDeclareType(VisitedSlot)
+
+struct Impl_VisitedSlot {
+    uint32_t hash;
+    uint32_t pos; /* index in `visited` plus one; zero if the slot is empty */
+};
+
 struct Impl_Visited {
-    iMutex *mtx;
-    iSortedArray visited;
+    iMutex *      mtx;
+    iArray        visited; /* VisitedUrl, in no particular order */
+    iVisitedSlot *slots;   /* open-addressing hash index of `visited` */
+    size_t        numSlots;
+    iBlock        log;     /* records not yet written to disk */
+    size_t        numLogRecords;
+    size_t        numFileRecords;
+    iBool         isCompactNeeded;
+    iAtomicInt    bloom[numBloomWords_Visited_];
 };
 
 iDefineTypeConstruction(Visited)
 
 void init_Visited(iVisited *d) {
     d->mtx = new_Mutex();
-    init_SortedArray(&d->visited, sizeof(iVisitedUrl), cmpUrl_VisitedUrl_);
+    init_Array(&d->visited, sizeof(iVisitedUrl));
+    d->numSlots = 1024;
+    d->slots    = calloc(d->numSlots, sizeof(iVisitedSlot));
+    init_Block(&d->log, 0);
+    d->numLogRecords   = 0;
+    d->numFileRecords  = 0;
+    d->isCompactNeeded = iFalse;
+    for (size_t i = 0; i < numBloomWords_Visited_; i++) {
+        set_Atomic(&d->bloom[i], 0);
+    }
 }
 
 void deinit_Visited(iVisited *d) {
     iGuardMutex(d->mtx, {
         clear_Visited(d);
-        deinit_SortedArray(&d->visited);
+        deinit_Array(&d->visited);
+        deinit_Block(&d->log);
+        free(d->slots);
     });
     delete_Mutex(d->mtx);
 }
 
-void save_Visited(const iVisited *d, const char *dirPath) {
-    iString *line = new_String();
-    iFile *f = newCStr_File(concatPath_CStr(dirPath, "visited.txt"));
-    if (open_File(f, writeOnly_FileMode | text_FileMode)) {
-        lock_Mutex(d->mtx);
-        iConstForEach(Array, i, &d->visited.values) {
-            const iVisitedUrl *item = i.value;
-            iDate date;
-            init_Date(&date, &item->when);
-            format_String(line,
-                          "%04d-%02d-%02dT%02d:%02d:%02d %04x %s\n",
-                          date.year,
-                          date.month,
-                          date.day,
-                          date.hour,
-                          date.minute,
-                          date.second,
-                          item->flags,
-                          cstr_String(&item->url));
-            writeData_File(f, cstr_String(line), size_String(line));
+static void bloomBits_Visited_(uint32_t hash, uint32_t bits[2]) {
+    bits[0] = hash % numBloomBits_Visited_;
+    bits[1] = ((hash >> 16 | hash << 16) * 0x9e3779b1) % numBloomBits_Visited_;
+}
+
+static void addBloom_Visited_(iVisited *d, uint32_t hash) {
+    uint32_t bits[2];
+    bloomBits_Visited_(hash, bits);
+    for (int i = 0; i < 2; i++) {
+        iAtomicInt *word = &d->bloom[bits[i] / 32];
+        set_Atomic(word, value_Atomic(word) | (int) (1u << (bits[i] % 32)));
+    }
+}
+
+static iBool mayContain_Visited_(const iVisited *d, uint32_t hash) {
+    uint32_t bits[2];
+    bloomBits_Visited_(hash, bits);
+    for (int i = 0; i < 2; i++) {
+        if (!((unsigned) value_Atomic(&d->bloom[bits[i] / 32]) & (1u << (bits[i] % 32)))) {
+            return iFalse;
+        }
+    }
+    return iTrue;
+}
+
+static size_t find_Visited_(const iVisited *d, iRangecc url, uint32_t hash) {
+    const size_t mask = d->numSlots - 1;
+    for (size_t i = hash & mask; d->slots[i].pos; i = (i + 1) & mask) {
+        const iVisitedSlot *slot = &d->slots[i];
+        if (slot->hash == hash) {
+            const iVisitedUrl *item = constAt_Array(&d->visited, slot->pos - 1);
+            if (equalUrl_VisitedUrl_(item, url)) {
+                return slot->pos - 1;
+            }
         }
-        unlock_Mutex(d->mtx);
+    }
+    return iInvalidPos;
+}
+
+static void insertSlot_Visited_(iVisited *d, uint32_t hash, size_t pos) {
+    const size_t mask = d->numSlots - 1;
+    size_t i = hash & mask;
+    while (d->slots[i].pos) {
+        i = (i + 1) & mask;
+    }
+    d->slots[i] = (iVisitedSlot){ hash, (uint32_t) pos + 1 };
+}
+
+static void rehash_Visited_(iVisited *d) {
+    /* Also rebuilds the Bloom filter, which is needed after removals. */
+    /* Keep the load factor under 50%. */
+    size_t numSlots = 1024;
+    while (numSlots < 2 * size_Array(&d->visited)) {
+        numSlots *= 2;
+    }
+    if (numSlots != d->numSlots) {
+        free(d->slots);
+        d->numSlots = numSlots;
+        d->slots    = calloc(numSlots, sizeof(iVisitedSlot));
+    }
+    else {
+        memset(d->slots, 0, sizeof(iVisitedSlot) * numSlots);
+    }
+    uint32_t *bloom = calloc(numBloomWords_Visited_, sizeof(uint32_t));
+    iConstForEach(Array, i, &d->visited) {
+        const iVisitedUrl *item = i.value;
+        const uint32_t     hash = urlHash_Visited(range_String(&item->url));
+        uint32_t           bits[2];
+        insertSlot_Visited_(d, hash, index_ArrayConstIterator(&i));
+        bloomBits_Visited_(hash, bits);
+        bloom[bits[0] / 32] |= 1u << (bits[0] % 32);
+        bloom[bits[1] / 32] |= 1u << (bits[1] % 32);
+    }
+    for (size_t i = 0; i < numBloomWords_Visited_; i++) {
+        set_Atomic(&d->bloom[i], (int) bloom[i]);
+    }
+    free(bloom);
+}
+
+static iVisitedUrl *upsert_Visited_(iVisited *d, iRangecc url, iTime when, uint16_t flags) {
+    const uint32_t hash = urlHash_Visited(url);
+    const size_t   pos  = find_Visited_(d, url, hash);
+    iVisitedUrl    visit;
+    visit.when  = when;
+    visit.flags = flags;
+    if (pos != iInvalidPos) {
+        iVisitedUrl *old = at_Array(&d->visited, pos);
+        if (!cmpNewer_VisitedUrl_(&visit, old)) {
+            return NULL;
+        }
+        old->when  = when;
+        old->flags = flags;
+        return old;
+    }
+    initRange_String(&visit.url, url);
+    pushBack_Array(&d->visited, &visit);
+    if (2 * size_Array(&d->visited) > d->numSlots) {
+        rehash_Visited_(d);
+    }
+    else {
+        insertSlot_Visited_(d, hash, size_Array(&d->visited) - 1);
+        addBloom_Visited_(d, hash);
+    }
+    return back_Array(&d->visited);
+}
+
+static iBool remove_Visited_(iVisited *d, iRangecc url) {
+    const size_t pos = find_Visited_(d, url, urlHash_Visited(url));
+    if (pos == iInvalidPos) {
+        return iFalse;
+    }
+    deinit_VisitedUrl(at_Array(&d->visited, pos));
+    /* Move the last entry to the vacated position. Removals are rare (user actions), so the
+       index is simply rebuilt. */
+    if (pos != size_Array(&d->visited) - 1) {
+        memcpy(at_Array(&d->visited, pos), back_Array(&d->visited), sizeof(iVisitedUrl));
+    }
+    popBack_Array(&d->visited);
+    rehash_Visited_(d);
+    return iTrue;
+}
+
+static void appendUInt_Visited_(iBlock *log, uint64_t value, size_t size) {
+    uint8_t bytes[8];
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (uint8_t) (value >> (8 * i));
+    }
+    appendData_Block(log, bytes, size);
+}
+
+static uint64_t uint_Visited_(const uint8_t *bytes, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint64_t) bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+static void appendRecord_Visited_(iBlock *log, enum iVisitedRecordType type,
+                                  const iVisitedUrl *item) {
+    appendUInt_Visited_(log, type, 1);
+    appendUInt_Visited_(log, item->flags, 2);
+    appendUInt_Visited_(log, (uint64_t) item->when.ts.tv_sec, 8);
+    appendUInt_Visited_(log, size_String(&item->url), 4);
+    appendData_Block(log, constData_Block(&item->url.chars), size_String(&item->url));
+}
+
+static void log_Visited_(iVisited *d, enum iVisitedRecordType type, const iVisitedUrl *item) {
+    appendRecord_Visited_(&d->log, type, item);
+    d->numLogRecords++;
+}
+
+static iBool writeCompacted_Visited_(iVisited *d, const iString *path) {
+    iBlock *data = new_Block(0);
+    appendData_Block(data, magic_Visited_, 4);
+    appendUInt_Visited_(data, latest_FileVersion, 4);
+    iTime now;
+    initCurrent_Time(&now);
+    size_t numRecords = 0;
+    iConstForEach(Array, i, &d->visited) {
+        const iVisitedUrl *item = i.value;
+        if (secondsSince_Time(&now, &item->when) <= maxAge_Visited) {
+            appendRecord_Visited_(data, visit_VisitedRecordType, item);
+            numRecords++;
+        }
+    }
+    iString *tempPath = collectNewFormat_String("%s.tmp", cstr_String(path));
+    iBool isWritten = iFalse;
+    iFile *f = new_File(tempPath);
+    if (open_File(f, writeOnly_FileMode)) {
+        isWritten = writeData_File(f, constData_Block(data), size_Block(data)) == size_Block(data);
     }
     iRelease(f);
-    delete_String(line);
+    delete_Block(data);
+    if (isWritten) {
+#if defined (iPlatformMsys)
+        remove(cstr_String(path));
+#endif
+        isWritten = rename(cstr_String(tempPath), cstr_String(path)) == 0;
+    }
+    if (isWritten) {
+        d->numFileRecords = numRecords;
+    }
+    return isWritten;
 }
 
-void load_Visited(iVisited *d, const char *dirPath) {
-    iFile *f = newCStr_File(concatPath_CStr(dirPath, "visited.txt"));
+static iBool isCompactNeeded_Visited_(const iVisited *d) {
+    return d->isCompactNeeded ||
+           d->numFileRecords + d->numLogRecords > 2 * size_Array(&d->visited) + 1000;
+}
+
+void save_Visited(iVisited *d, const char *dirPath) {
+    iString *path = cleanedCStr_Path(concatPath_CStr(dirPath, fileName_Visited_));
+    lock_Mutex(d->mtx);
+    if (isCompactNeeded_Visited_(d) || !fileExistsCStr_FileInfo(cstr_String(path))) {
+        if (writeCompacted_Visited_(d, path)) {
+            d->isCompactNeeded = iFalse;
+            clear_Block(&d->log);
+            d->numLogRecords = 0;
+        }
+    }
+    else if (!isEmpty_Block(&d->log)) {
+        iFile *f = new_File(path);
+        if (open_File(f, append_FileMode)) {
+            if (writeData_File(f, constData_Block(&d->log), size_Block(&d->log)) ==
+                size_Block(&d->log)) {
+                d->numFileRecords += d->numLogRecords;
+                clear_Block(&d->log);
+                d->numLogRecords = 0;
+            }
+            else {
+                /* The log may now end in a partial record. */
+                d->isCompactNeeded = iTrue;
+            }
+        }
+        iRelease(f);
+    }
+    unlock_Mutex(d->mtx);
+    delete_String(path);
+}
+
+static void loadOldFormat_Visited_(iVisited *d, const char *dirPath) {
+    iFile *f = newCStr_File(concatPath_CStr(dirPath, oldFileName_Visited_));
     if (open_File(f, readOnly_FileMode | text_FileMode)) {
-        lock_Mutex(d->mtx);
         const iRangecc src  = range_Block(collect_Block(readAll_File(f)));
         iRangecc       line = iNullRange;
-        iTime          now;
-        initCurrent_Time(&now);
         while (nextSplit_Rangecc(src, "\n", &line)) {
             if (size_Range(&line) < 22) continue;
             int y, m, D, H, M, S;
             sscanf(line.start, "%04d-%02d-%02dT%02d:%02d:%02d ", &y, &m, &D, &H, &M, &S);
             if (!y) break;
-            iVisitedUrl item;
-            init_VisitedUrl(&item);
+            uint16_t flags = 0;
             const char *urlStart = line.start + 20;
             if (*urlStart == '0' && size_Range(&line) >= 25) {
-                item.flags = strtoul(line.start + 20, NULL, 16);
+                flags = strtoul(line.start + 20, NULL, 16);
                 urlStart += 5;
             }
-            init_Time(
-                &item.when,
-                &(iDate){ .year = y, .month = m, .day = D, .hour = H, .minute = M, .second = S });
-            if (secondsSince_Time(&now, &item.when) > maxAge_Visited) {
-                continue; /* Too old. */
+            iTime when;
+            init_Time(&when,
+                      &(iDate){ .year = y, .month = m, .day = D, .hour = H, .minute = M, .second = S });
+            upsert_Visited_(d, (iRangecc){ urlStart, line.end }, when, flags);
+        }
+        /* Convert to the binary log on the next save. */
+        d->isCompactNeeded = iTrue;
+    }
+    iRelease(f);
+}
+
+static void loadLog_Visited_(iVisited *d, const iBlock *data) {
+    const uint8_t *pos = constData_Block(data);
+    const uint8_t *end = pos + size_Block(data);
+    if (size_Block(data) < 8 || memcmp(pos, magic_Visited_, 4) ||
+        uint_Visited_(pos + 4, 4) > latest_FileVersion) {
+        d->isCompactNeeded = iTrue;
+        return;
+    }
+    pos += 8; /* magic and version */
+    while (pos < end) {
+        if ((size_t) (end - pos) < recordHeaderSize_Visited_) {
+            break;
+        }
+        const int      type     = pos[0];
+        const uint16_t flags    = (uint16_t) uint_Visited_(pos + 1, 2);
+        const uint64_t seconds  = uint_Visited_(pos + 3, 8);
+        const size_t   urlSize  = (size_t) uint_Visited_(pos + 11, 4);
+        const uint8_t *urlStart = pos + recordHeaderSize_Visited_;
+        if ((size_t) (end - urlStart) < urlSize) {
+            break;
+        }
+        const iRangecc url = { (const char *) urlStart, (const char *) urlStart + urlSize };
+        if (type == visit_VisitedRecordType) {
+            iTime when;
+            iZap(when);
+            when.ts.tv_sec = (time_t) seconds;
+            upsert_Visited_(d, url, when, flags);
+        }
+        else if (type == remove_VisitedRecordType) {
+            remove_Visited_(d, url);
+        }
+        pos = urlStart + urlSize;
+        d->numFileRecords++;
+    }
+    if (pos != end) {
+        /* Truncated or corrupt tail; rewrite the log with what could be read. */
+        d->isCompactNeeded = iTrue;
+    }
+}
+
+void load_Visited(iVisited *d, const char *dirPath) {
+    iFile *f = newCStr_File(concatPath_CStr(dirPath, fileName_Visited_));
+    lock_Mutex(d->mtx);
+    if (open_File(f, readOnly_FileMode)) {
+        loadLog_Visited_(d, collect_Block(readAll_File(f)));
+    }
+    else {
+        loadOldFormat_Visited_(d, dirPath);
+    }
+    /* Forget entries that are too old. */
+    iTime now;
+    initCurrent_Time(&now);
+    size_t numExpired = 0;
+    for (size_t i = 0; i < size_Array(&d->visited); ) {
+        iVisitedUrl *item = at_Array(&d->visited, i);
+        if (secondsSince_Time(&now, &item->when) > maxAge_Visited) {
+            deinit_VisitedUrl(item);
+            if (i != size_Array(&d->visited) - 1) {
+                memcpy(item, back_Array(&d->visited), sizeof(iVisitedUrl));
             }
-            initRange_String(&item.url, (iRangecc){ urlStart, line.end });
-            insert_SortedArray(&d->visited, &item);
+            popBack_Array(&d->visited);
+            numExpired++;
         }
-        unlock_Mutex(d->mtx);
+        else {
+            i++;
+        }
+    }
+    if (numExpired) {
+        rehash_Visited_(d);
     }
+    unlock_Mutex(d->mtx);
     iRelease(f);
 }
 
 void clear_Visited(iVisited *d) {
     lock_Mutex(d->mtx);
-    iForEach(Array, v, &d->visited.values) {
+    iForEach(Array, v, &d->visited) {
         deinit_VisitedUrl(v.value);
     }
-    clear_SortedArray(&d->visited);
+    clear_Array(&d->visited);
+    memset(d->slots, 0, sizeof(iVisitedSlot) * d->numSlots);
+    for (size_t i = 0; i < numBloomWords_Visited_; i++) {
+        set_Atomic(&d->bloom[i], 0);
+    }
+    clear_Block(&d->log);
+    d->numLogRecords   = 0;
+    d->isCompactNeeded = iTrue;
     unlock_Mutex(d->mtx);
 }
 
-static size_t find_Visited_(const iVisited *d, const iString *url) {
-    iVisitedUrl visit;
-    init_VisitedUrl(&visit);
-    set_String(&visit.url, url);
-    size_t pos = iInvalidPos;
-    iGuardMutex(d->mtx, {
-        locate_SortedArray(&d->visited, &visit, &pos);
-        deinit_VisitedUrl(&visit);
-    });
-    return pos;
-}
-
 void visitUrl_Visited(iVisited *d, const iString *url, uint16_t visitFlags) {
     if (isEmpty_String(url)) return;
-    iVisitedUrl visit;
-    init_VisitedUrl(&visit);
-    visit.flags = visitFlags;
-    set_String(&visit.url, url);
-    size_t pos;
+    iTime now;
+    initCurrent_Time(&now);
     lock_Mutex(d->mtx);
-    if (locate_SortedArray(&d->visited, &visit, &pos)) {
-        iVisitedUrl *old = at_SortedArray(&d->visited, pos);
-        if (cmpNewer_VisitedUrl_(&visit, old)) {
-            old->when = visit.when;
-            old->flags = visitFlags;
-            unlock_Mutex(d->mtx);
-            deinit_VisitedUrl(&visit);
-            return;
-        }
+    const iVisitedUrl *item = upsert_Visited_(d, range_String(url), now, visitFlags);
+    if (item) {
+        log_Visited_(d, visit_VisitedRecordType, item);
     }
-    insert_SortedArray(&d->visited, &visit);
     unlock_Mutex(d->mtx);
 }
 
 void removeUrl_Visited(iVisited *d, const iString *url) {
     iGuardMutex(d->mtx, {
-        size_t pos = find_Visited_(d, url);
-        if (pos < size_SortedArray(&d->visited)) {
-            iVisitedUrl *visUrl = at_SortedArray(&d->visited, pos);
-            if (equal_String(&visUrl->url, url)) {
-                deinit_VisitedUrl(visUrl);
-                remove_Array(&d->visited.values, pos);
-            }
+        if (remove_Visited_(d, range_String(url))) {
+            iVisitedUrl item;
+            init_VisitedUrl(&item);
+            set_String(&item.url, url);
+            log_Visited_(d, remove_VisitedRecordType, &item);
+            deinit_VisitedUrl(&item);
         }
     });
 }
 
-iTime urlVisitTime_Visited(const iVisited *d, const iString *url) {
-    iVisitedUrl item;
-    size_t pos;
-    iZap(item);
-    initCopy_String(&item.url, url);
+iTime visitTime_Visited(const iVisited *d, iRangecc url, uint32_t urlHash) {
+    iTime when;
+    iZap(when);
+    if (!mayContain_Visited_(d, urlHash)) {
+        return when;
+    }
     lock_Mutex(d->mtx);
-    if (locate_SortedArray(&d->visited, &item, &pos)) {
-        item.when = ((const iVisitedUrl *) constAt_SortedArray(&d->visited, pos))->when;
+    const size_t pos = find_Visited_(d, url, urlHash);
+    if (pos != iInvalidPos) {
+        when = ((const iVisitedUrl *) constAt_Array(&d->visited, pos))->when;
     }
     unlock_Mutex(d->mtx);
-    deinit_String(&item.url);
-    return item.when;
+    return when;
+}
+
+iTime urlVisitTime_Visited(const iVisited *d, const iString *url) {
+    const iRangecc range = range_String(url);
+    return visitTime_Visited(d, range, urlHash_Visited(range));
 }
 
 iBool containsUrl_Visited(const iVisited *d, const iString *url) {
@@ -216,7 +533,7 @@ static int cmpWhenDescending_VisitedUrlPtr_(const void *a, const void *b) {
 const iArray *list_Visited(const iVisited *d, size_t count) {
     iPtrArray *urls = collectNew_PtrArray();
     iGuardMutex(d->mtx, {
-        iConstForEach(Array, i, &d->visited.values) {
+        iConstForEach(Array, i, &d->visited) {
             const iVisitedUrl *vis = i.value;
             if (~vis->flags & transient_VisitedUrlFlag) {
                 pushBack_PtrArray(urls, vis);
@@ -48,9 +48,12 @@ iDeclareTypeConstruction(Visited)
 
 void    clear_Visited           (iVisited *);
 void    load_Visited            (iVisited *, const char *dirPath);
-void    save_Visited            (const iVisited *, const char *dirPath);
+void    save_Visited            (iVisited *, const char *dirPath);
+
+uint32_t urlHash_Visited        (iRangecc url);
 
 iTime   urlVisitTime_Visited    (const iVisited *, const iString *url);
+iTime   visitTime_Visited       (const iVisited *, iRangecc url, uint32_t urlHash); /* thread-safe */
 void    visitUrl_Visited        (iVisited *, const iString *url, uint16_t visitFlags); /* adds URL to the visited URLs set */
 void    removeUrl_Visited       (iVisited *, const iString *url);
 iBool   containsUrl_Visited     (const iVisited *, const iString *url);